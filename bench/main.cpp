@@ -0,0 +1,396 @@
+// Copyright (c) 2019 Petr Petrov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// Microbenchmarks of the shader math and of the pipeline stages, and standard scenes rendered at several
+// resolutions in both render modes. Usage: bench [seconds per measurement, default 0.5]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include "bgfx_cpu_emulation.h"
+
+using namespace BGFXShaderCPUEmulator;
+
+struct BenchProgram : ShaderProgram<BenchProgram>
+{
+#include "varying.def.sc"
+
+#define main vertex_shader_main
+#include "vs_bench.sc"
+#undef main
+
+#define main fragment_shader_main
+#include "fs_bench.sc"
+#undef main
+};
+
+struct Vertex
+{
+    float position[3];
+    uint32_t abgr;
+};
+
+struct Mesh
+{
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> indices;
+    std::vector<float> instances; // 4 columns of the model matrix per instance, empty for one identity instance
+    mat4 view_proj;
+};
+
+static double min_seconds = 0.5;
+
+// Runs body until min_seconds have passed (at least 3 times), returns nanoseconds per run
+template <typename Body>
+static double measure(Body body)
+{
+    typedef std::chrono::steady_clock Clock;
+    body(); // Warm up caches, thread pools and lazily allocated buffers
+    size_t runs = 0;
+    const Clock::time_point start = Clock::now();
+    double elapsed = 0.0;
+    while (runs < 3 || elapsed < min_seconds)
+    {
+        body();
+        ++runs;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    return elapsed * 1e9 / static_cast<double>(runs);
+}
+
+static volatile float sink;
+
+static uint32_t nextRandom(uint32_t& state)
+{
+    state = state * 1664525u + 1013904223u;
+    return state >> 8;
+}
+
+static float random01(uint32_t& state)
+{
+    return static_cast<float>(nextRandom(state) & 0xffff) / 65535.0f;
+}
+
+static void addTriangle(Mesh& mesh, const float positions[9], uint32_t abgr)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        Vertex vertex = { { positions[i * 3], positions[i * 3 + 1], positions[i * 3 + 2] }, abgr };
+        mesh.indices.push_back(static_cast<uint32_t>(mesh.vertices.size()));
+        mesh.vertices.push_back(vertex);
+    }
+}
+
+static mat4 perspective(float aspect)
+{
+    const float f = 1.0f / std::tan(0.5f);
+    const float near_z = 0.5f;
+    const float far_z = 100.0f;
+    return mtxFromRows(vec4(f / aspect, 0.0f, 0.0f, 0.0f), vec4(0.0f, f, 0.0f, 0.0f),
+        vec4(0.0f, 0.0f, (far_z + near_z) / (near_z - far_z), 2.0f * far_z * near_z / (near_z - far_z)), vec4(0.0f, 0.0f, -1.0f, 0.0f));
+}
+
+// Scenes in normalized device coordinates, so they cover the same part of the screen at every resolution
+
+static Mesh smallTriangles(float)
+{
+    Mesh mesh;
+    uint32_t state = 1;
+    for (int i = 0; i < 100000; ++i)
+    {
+        const float x = random01(state) * 1.9f - 0.95f;
+        const float y = random01(state) * 1.9f - 0.95f;
+        const float z = random01(state);
+        const float positions[9] = { x, y, z, x + 0.006f, y, z, x, y + 0.008f, z };
+        addTriangle(mesh, positions, nextRandom(state) | 0xff000000u);
+    }
+    return mesh;
+}
+
+static Mesh hugeTriangles(float)
+{
+    Mesh mesh;
+    uint32_t state = 2;
+    for (int i = 0; i < 8; ++i)
+    {
+        const float z = random01(state);
+        const float positions[9] = { -3.0f, -1.0f, z, 1.0f, -1.0f, z, 1.0f, 3.0f, z };
+        addTriangle(mesh, positions, nextRandom(state) | 0xff000000u);
+    }
+    return mesh;
+}
+
+// Screen sized quads drawn back to front, every one passes the depth test everywhere
+static Mesh overdraw(float)
+{
+    Mesh mesh;
+    uint32_t state = 3;
+    for (int i = 0; i < 32; ++i)
+    {
+        const float z = 0.99f - i * 0.03f;
+        const uint32_t abgr = nextRandom(state) | 0xff000000u;
+        const float first[9] = { -1.0f, -1.0f, z, 1.0f, -1.0f, z, 1.0f, 1.0f, z };
+        const float second[9] = { -1.0f, -1.0f, z, 1.0f, 1.0f, z, -1.0f, 1.0f, z };
+        addTriangle(mesh, first, abgr);
+        addTriangle(mesh, second, abgr);
+    }
+    return mesh;
+}
+
+// One indexed cube drawn with 10000 instances in perspective
+static Mesh cubes(float aspect)
+{
+    Mesh mesh;
+    uint32_t state = 4;
+    for (int face = 0; face < 6; ++face)
+    {
+        const int axis = face / 2;
+        const float side = face % 2 ? 0.5f : -0.5f;
+        const uint32_t abgr = nextRandom(state) | 0xff000000u;
+        const uint32_t first = static_cast<uint32_t>(mesh.vertices.size());
+        for (int corner = 0; corner < 4; ++corner)
+        {
+            float position[3];
+            position[axis] = side;
+            position[(axis + 1) % 3] = corner & 1 ? 0.5f : -0.5f;
+            position[(axis + 2) % 3] = corner & 2 ? 0.5f : -0.5f;
+            Vertex vertex = { { position[0], position[1], position[2] }, abgr };
+            mesh.vertices.push_back(vertex);
+        }
+        const uint32_t quad[6] = { 0, 1, 3, 0, 3, 2 };
+        for (int i = 0; i < 6; ++i)
+        {
+            mesh.indices.push_back(first + quad[i]);
+        }
+    }
+    for (int i = 0; i < 10000; ++i)
+    {
+        const float z = -5.0f - random01(state) * 45.0f;
+        const float x = (random01(state) * 2.0f - 1.0f) * -z * 0.6f * aspect;
+        const float y = (random01(state) * 2.0f - 1.0f) * -z * 0.6f;
+        const float angle = random01(state) * 6.283f;
+        const float columns[16] = { std::cos(angle), 0.0f, -std::sin(angle), 0.0f, 0.0f, 1.0f, 0.0f, 0.0f,
+            std::sin(angle), 0.0f, std::cos(angle), 0.0f, x, y, z, 1.0f };
+        mesh.instances.insert(mesh.instances.end(), columns, columns + 16);
+    }
+    mesh.view_proj = perspective(aspect);
+    return mesh;
+}
+
+// Long triangles about a pixel wide at 1080p, most of their pixels are on edges
+static Mesh slivers(float)
+{
+    Mesh mesh;
+    uint32_t state = 5;
+    for (int i = 0; i < 20000; ++i)
+    {
+        const float x0 = random01(state) * 2.0f - 1.0f;
+        const float y0 = random01(state) * 2.0f - 1.0f;
+        const float x1 = random01(state) * 2.0f - 1.0f;
+        const float y1 = random01(state) * 2.0f - 1.0f;
+        const float z = random01(state);
+        const float positions[9] = { x0, y0, z, x1, y1, z, x1 + 0.002f, y1 + 0.002f, z };
+        addTriangle(mesh, positions, nextRandom(state) | 0xff000000u);
+    }
+    return mesh;
+}
+
+static void setupDraw(CPURendering& renderer, BenchProgram& program, const Mesh& mesh, const VertexLayout& layout, const VertexLayout& instance_layout)
+{
+    program.u_modelViewProj = mesh.view_proj;
+    // Meshes without instance data are drawn once with the identity model matrix
+    program.i_data0 = vec4(1.0f, 0.0f, 0.0f, 0.0f);
+    program.i_data1 = vec4(0.0f, 1.0f, 0.0f, 0.0f);
+    program.i_data2 = vec4(0.0f, 0.0f, 1.0f, 0.0f);
+    program.i_data3 = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    renderer.setProgram(program);
+    renderer.setVertexBuffer(0, mesh.vertices.data(), mesh.vertices.size(), layout);
+    renderer.setIndexBuffer(mesh.indices.data(), mesh.indices.size() / 3);
+    renderer.setInstanceDataBuffer(mesh.instances.empty() ? 0 : mesh.instances.data(), mesh.instances.size() / 16, instance_layout);
+}
+
+static void benchMath()
+{
+    const size_t count = 4096;
+    std::vector<vec4> values(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        values[i] = vec4(i * 0.001f, 1.0f - i * 0.0005f, 0.5f, 1.0f);
+    }
+    const mat4 matrix(vec4(0.9f, 0.1f, 0.0f, 0.0f), vec4(-0.1f, 0.9f, 0.0f, 0.0f), vec4(0.0f, 0.0f, 1.0f, 0.0f), vec4(0.2f, 0.3f, 0.4f, 1.0f));
+
+    const double arithmetic = measure([&]()
+    {
+        vec4 sum(0.0f, 0.0f, 0.0f, 0.0f);
+        for (size_t i = 0; i < count; ++i)
+        {
+            sum = sum + values[i] * vec4(0.5f, 0.5f, 0.5f, 0.5f) - values[i] / vec4(3.0f, 3.0f, 3.0f, 3.0f);
+        }
+        sink = sum.x + sum.w;
+    });
+    const double functions = measure([&]()
+    {
+        float sum = 0.0f;
+        for (size_t i = 0; i < count; ++i)
+        {
+            const vec3 v = normalize(vec3(values[i]) + 0.1f);
+            sum += dot(v, vec3(0.3f, 0.5f, 0.2f)) + clamp(values[i].x, 0.2f, 0.8f) + mix(values[i].y, values[i].z, 0.3f);
+        }
+        sink = sum;
+    });
+    const double multiply = measure([&]()
+    {
+        vec4 sum(0.0f, 0.0f, 0.0f, 0.0f);
+        for (size_t i = 0; i < count; ++i)
+        {
+            sum = sum + mul(matrix, values[i]);
+        }
+        sink = sum.x + sum.w;
+    });
+    std::printf("%-40s %10.2f Mops/s\n", "vec4 add, mul, div", 3.0 * count / arithmetic * 1e3);
+    std::printf("%-40s %10.2f Mops/s\n", "normalize, dot, clamp, mix", count / functions * 1e3);
+    std::printf("%-40s %10.2f Mops/s\n", "mul(mat4, vec4)", count / multiply * 1e3);
+}
+
+static void benchVertexFetch()
+{
+    const size_t count = 4096;
+    std::vector<Vertex> vertices(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        Vertex vertex = { { i * 0.1f, i * 0.2f, i * 0.3f }, static_cast<uint32_t>(i * 2654435761u) };
+        vertices[i] = vertex;
+    }
+    VertexLayout layout;
+    layout.begin()
+        .add(&BenchProgram::a_position, 3, AttribType::Float)
+        .add(&BenchProgram::a_color0, 4, AttribType::Uint8, true)
+        .end();
+    BenchProgram program;
+    const double fetch = measure([&]()
+    {
+        float sum = 0.0f;
+        for (size_t i = 0; i < count; ++i)
+        {
+            layout.decode(program, reinterpret_cast<const unsigned char*>(&vertices[i]));
+            sum += program.a_color0.y;
+        }
+        sink = sum;
+    });
+    std::printf("%-40s %10.2f Mverts/s\n", "vertex fetch (float3 + unorm8x4)", count / fetch * 1e3);
+}
+
+// Every triangle is shaded and set up, but the scissor rectangle leaves nothing to rasterize
+static void benchTriangleSetup(const VertexLayout& layout, const VertexLayout& instance_layout)
+{
+    CPURendering renderer(1280, 720);
+    BenchProgram program;
+    renderer.output_attributes.push_back(Attribute(&BenchProgram::v_color0));
+    const Mesh mesh = smallTriangles(1280.0f / 720.0f);
+    setupDraw(renderer, program, mesh, layout, instance_layout);
+    renderer.setScissor(0, 0, 1, 1);
+    const double frame = measure([&]()
+    {
+        renderer.render();
+    });
+    std::printf("%-40s %10.2f Mtris/s\n", "vertex shading + triangle setup", mesh.indices.size() / 3 / frame * 1e3);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1)
+    {
+        min_seconds = std::atof(argv[1]);
+    }
+#ifndef NDEBUG
+    std::printf("Assertions are enabled, build with optimizations and NDEBUG for representative numbers\n");
+#endif
+
+    VertexLayout layout;
+    layout.begin()
+        .add(&BenchProgram::a_position, 3, AttribType::Float)
+        .add(&BenchProgram::a_color0, 4, AttribType::Uint8, true)
+        .end();
+    VertexLayout instance_layout;
+    instance_layout.begin()
+        .add(&BenchProgram::i_data0, 4, AttribType::Float)
+        .add(&BenchProgram::i_data1, 4, AttribType::Float)
+        .add(&BenchProgram::i_data2, 4, AttribType::Float)
+        .add(&BenchProgram::i_data3, 4, AttribType::Float)
+        .end();
+
+    std::printf("Microbenchmarks\n");
+    benchMath();
+    benchVertexFetch();
+    benchTriangleSetup(layout, instance_layout);
+
+    struct Scene
+    {
+        const char* name;
+        Mesh (*create)(float aspect);
+    };
+    const Scene scenes[] =
+    {
+        { "small triangles", smallTriangles },
+        { "huge triangles", hugeTriangles },
+        { "overdraw", overdraw },
+        { "cubes", cubes },
+        { "slivers", slivers }
+    };
+    const unsigned resolutions[][2] = { { 320, 240 }, { 1280, 720 }, { 1920, 1080 } };
+
+    std::printf("\n%-16s %-10s %-10s %12s %12s %12s %12s %12s\n", "Scene", "Size", "Mode", "ns/frame", "verts/s", "tris/s", "pixels/s", "frags/s");
+    for (size_t scene = 0; scene < sizeof(scenes) / sizeof(scenes[0]); ++scene)
+    {
+        for (size_t resolution = 0; resolution < sizeof(resolutions) / sizeof(resolutions[0]); ++resolution)
+        {
+            const unsigned width = resolutions[resolution][0];
+            const unsigned height = resolutions[resolution][1];
+            const Mesh mesh = scenes[scene].create(static_cast<float>(width) / height);
+            for (int tiled = 0; tiled < 2; ++tiled)
+            {
+                CPURendering renderer(width, height);
+                BenchProgram program;
+                renderer.output_attributes.push_back(Attribute(&BenchProgram::v_color0));
+                if (tiled)
+                {
+                    renderer.setRenderMode(RenderMode::Tiled);
+                }
+                setupDraw(renderer, program, mesh, layout, instance_layout);
+                const double frame = measure([&]()
+                {
+                    renderer.clear();
+                    renderer.render();
+                });
+                // Every frame draws the same, so the counts of the last one hold for all
+                const Stats stats = renderer.getStats();
+                char size[32];
+                std::snprintf(size, sizeof(size), "%ux%u", width, height);
+                std::printf("%-16s %-10s %-10s %12.0f %12.3g %12.3g %12.3g %12.3g\n", scenes[scene].name, size, tiled ? "tiled" : "immediate", frame,
+                    static_cast<double>(stats.vertex_shader_invocations) / frame * 1e9,
+                    static_cast<double>(stats.triangles_submitted) / frame * 1e9,
+                    static_cast<double>(width) * height / frame * 1e9,
+                    static_cast<double>(stats.fragment_shader_invocations) / frame * 1e9);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,7 @@
+vec4 v_color0 = vec4(1.0, 0.0, 0.0, 1.0);
+vec3 a_position;
+vec4 a_color0;
+vec4 i_data0;
+vec4 i_data1;
+vec4 i_data2;
+vec4 i_data3;
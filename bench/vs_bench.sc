@@ -0,0 +1,12 @@
+#include <bgfx_shader.sh>
+
+void main()
+{
+	mat4 model;
+	model[0] = i_data0;
+	model[1] = i_data1;
+	model[2] = i_data2;
+	model[3] = i_data3;
+	gl_Position = mul(u_modelViewProj, instMul(model, vec4(a_position, 1.0) ) );
+	v_color0 = a_color0;
+}
@@ -18,6 +18,14 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include "bgfx_cpu_emulation.h"
+
+using namespace BGFXShaderCPUEmulator;
+
+struct CubesProgram : ShaderProgram<CubesProgram>
+{
+#include "varying.def.sc"
+
 #define main vertex_shader_main
 #include "vs_cubes.sc"
 #undef main
@@ -25,33 +33,53 @@
 #define main fragment_shader_main
 #include "fs_cubes.sc"
 #undef main
+};
 
-#include "bgfx_cpu_emulation.h"
+struct CubesLaneProgram : LaneShaderProgram<CubesLaneProgram>
+{
+#include "bgfx_shader_lanes_begin.sh"
+#include "varying.def.sc"
 
-using namespace BGFXShaderCPUEmulator;
+#define main fragment_shader_main
+#include "fs_cubes.sc"
+#undef main
+#include "bgfx_shader_lanes_end.sh"
+};
 
 int main()
 {
     CPURendering renderer(640, 480);
 
-    renderer.input_attributes.push_back(Attribute(&a_position));
-    renderer.input_attributes.push_back(Attribute(&a_color0));
-    renderer.output_attributes.push_back(Attribute(&v_color0));
+    CubesProgram program;
+    // Vertex positions are in pixels, relative to the center of the window
+    program.u_modelViewProj = mat4(vec4(2.0f / 640.0f, 0.0f, 0.0f, 0.0f), vec4(0.0f, 2.0f / 480.0f, 0.0f, 0.0f), vec4(0.0f, 0.0f, 1.0f, 0.0f), vec4(0.0f, 0.0f, 0.0f, 1.0f));
+    renderer.setProgram(program);
+
+    renderer.output_attributes.push_back(Attribute(&CubesProgram::v_color0));
+
+    CubesLaneProgram lane_program;
+    renderer.setLaneProgram(lane_program);
+    renderer.lane_input_attributes.push_back(Attribute(&CubesLaneProgram::v_color0));
 
     struct vertex_data
     {
-        vec3 position;
-        vec4 color;
+        float position[3];
+        uint32_t abgr;
     };
     vertex_data vertex_data[] =
     {
-        { { 0.0f, 0.0f, 0.0f }, {1.0f, 0.0f, 0.0f, 1.0f } },
-        { { 300.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f, 1.0f } },
-        { { 0.0f, 140.0f, 0.0f }, { 0.0f, 0.0f, 1.0f, 1.0f } }
+        { { 0.0f, 0.0f, 0.0f }, 0xff0000ff },
+        { { 300.0f, 0.0f, 0.0f }, 0xff00ff00 },
+        { { 0.0f, 140.0f, 0.0f }, 0xffff0000 }
     };
+    VertexLayout layout;
+    layout.begin()
+        .add(&CubesProgram::a_position, 3, AttribType::Float)
+        .add(&CubesProgram::a_color0, 4, AttribType::Uint8, true)
+        .end();
     uint16_t triangles[] = { 0, 1, 2 };
 
-    renderer.setVertexBuffer(vertex_data, sizeof(vertex_data) / sizeof(vertex_data[0]));
+    renderer.setVertexBuffer(0, vertex_data, sizeof(vertex_data) / sizeof(vertex_data[0]), layout);
     renderer.setIndexBuffer(triangles, sizeof(triangles) / sizeof(triangles[0]) / 3);
     renderer.render();
 
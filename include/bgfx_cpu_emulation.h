@@ -21,26 +21,153 @@
 #pragma once
 
 #include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
 #include <vector>
 #include <algorithm>
 #include <string>
 #include <fstream>
-#include "bgfx_shader.h"
-
-vec4 gl_Position;
-vec4 gl_FragColor;
-
-mat4 u_view;
-mat4 u_invView;
-mat4 u_proj;
-mat4 u_invProj;
-mat4 u_viewProj;
-mat4 u_invViewProj;
-mat4 u_modelView;
-mat4 u_modelViewProj;
+#include <future>
+#include <chrono>
+#include "bgfx_shader.sh"
+#include "bgfx_shader_lanes.h"
+#include "bgfx_cpu_thread_pool.h"
+#include "bgfx_cpu_image.h"
+#include "bgfx_cpu_texture_file.h"
+#include "bgfx_cpu_trace.h"
 
 namespace BGFXShaderCPUEmulator
 {
+    // Predefined uniforms, shared by the scalar and the per lane programs
+    struct ShaderUniforms
+    {
+        mat4 u_view;
+        mat4 u_invView;
+        mat4 u_proj;
+        mat4 u_invProj;
+        mat4 u_viewProj;
+        mat4 u_invViewProj;
+        mat4 u_modelView;
+        mat4 u_modelViewProj;
+    };
+
+    // Execution state of one shader invocation: builtins, uniforms and (in derived programs) varyings.
+    // Every thread shading with a program works on its own copy, so nothing mutable is shared.
+    struct ShaderContext : ShaderUniforms
+    {
+        vec4 gl_Position;
+        vec4 gl_FragColor;
+
+        // Screen space derivatives of texture2D. Fragment shaders sampling textures shade 2x2 pixel quads: pixel 1
+        // (x + 1, y) and pixel 2 (x, y + 1) of the quad, and pixel 0 (x, y) if it is not shaded, first run in
+        // QuadMode::Record, which records the coordinates of texture2D without sampling. Call i of texture2D in
+        // QuadMode::Sample then takes the mip of the coordinates of call i of the quad, as the lanes of
+        // LaneShaderContext do. Pixel 0 is shaded first and records its coordinates while sampling.
+        // Coordinates computed from texels are recorded with zero texels.
+        enum class QuadMode : unsigned char
+        {
+            None,
+            Record,
+            Sample
+        };
+        QuadMode quad_mode;
+        int quad_pixel; // Pixel of the quad being run, 0 - 3
+        std::vector<vec2> quad_coordinates[3]; // Coordinates of the texture2D calls of pixels 0 - 2
+        size_t texture_calls; // texture2D calls of the current run
+
+        ShaderContext() : quad_mode(QuadMode::None), quad_pixel(0), texture_calls(0)
+        {
+        }
+
+        virtual ~ShaderContext()
+        {
+        }
+
+        // Hides ::texture2D in the shaders of ShaderProgram
+        vec4 texture2D(const sampler2D& sampler, const vec2& uv)
+        {
+            const size_t call = texture_calls++;
+            if (quad_mode == QuadMode::Record)
+            {
+                quad_coordinates[quad_pixel].push_back(uv);
+                return vec4(0.0f, 0.0f, 0.0f, 0.0f);
+            }
+            float lod = 0.0f;
+            if (quad_mode == QuadMode::Sample)
+            {
+                if (quad_pixel == 0)
+                {
+                    quad_coordinates[0].push_back(uv);
+                }
+                if (call < quad_coordinates[0].size() && call < quad_coordinates[1].size() && call < quad_coordinates[2].size())
+                {
+                    lod = textureQuadLod(sampler, quad_coordinates[0][call], quad_coordinates[1][call], quad_coordinates[2][call]);
+                }
+            }
+            return sampler.sample(uv, lod);
+        }
+
+        virtual void vertex_shader_main() = 0;
+        virtual void fragment_shader_main() = 0;
+        virtual std::unique_ptr<ShaderContext> clone() const = 0;
+    };
+
+    // Base class for programs, the shader sources and varying.def.sc are included into the derived class body:
+    //
+    // struct CubesProgram : ShaderProgram<CubesProgram>
+    // {
+    // #include "varying.def.sc"
+    // #define main vertex_shader_main
+    // #include "vs_cubes.sc"
+    // #undef main
+    // ...
+    // };
+    template <typename Program>
+    struct ShaderProgram : ShaderContext
+    {
+        std::unique_ptr<ShaderContext> clone() const override
+        {
+            return std::unique_ptr<ShaderContext>(new Program(static_cast<const Program&>(*this)));
+        }
+    };
+
+    // Execution state of a fragment shader shading BGFXShaderLanes::lane_count pixels at once.
+    // Varyings and gl_FragColor hold one value per lane, uniforms are the same for all lanes.
+    struct LaneShaderContext : ShaderUniforms
+    {
+        BGFXShaderLanes::vec4 gl_FragColor;
+
+        virtual ~LaneShaderContext()
+        {
+        }
+
+        virtual void fragment_shader_main() = 0;
+        virtual std::unique_ptr<LaneShaderContext> clone() const = 0;
+    };
+
+    // Base class for per lane fragment programs, compiled from the same unmodified shader source:
+    //
+    // struct CubesLaneProgram : LaneShaderProgram<CubesLaneProgram>
+    // {
+    // #include "bgfx_shader_lanes_begin.sh"
+    // #include "varying.def.sc"
+    // #define main fragment_shader_main
+    // #include "fs_cubes.sc"
+    // #undef main
+    // #include "bgfx_shader_lanes_end.sh"
+    // };
+    template <typename Program>
+    struct LaneShaderProgram : LaneShaderContext
+    {
+        std::unique_ptr<LaneShaderContext> clone() const override
+        {
+            return std::unique_ptr<LaneShaderContext>(new Program(static_cast<const Program&>(*this)));
+        }
+    };
+
     enum class AttributeType : unsigned char
     {
         AttributeFloat,
@@ -53,84 +180,80 @@ namespace BGFXShaderCPUEmulator
     class Attribute
     {
         AttributeType type;
+        size_t offset; // Offset of the varying inside of ShaderContext
 
-        union
+        static const unsigned char* contextAddress(const ShaderContext& context)
         {
-            float* varying_float;
-            vec2* varying_vec2;
-            vec3* varying_vec3;
-            vec4* varying_vec4;
-            mat4* varying_mat4;
-        };
+            return reinterpret_cast<const unsigned char*>(&context);
+        }
 
-        union
+        static const unsigned char* contextAddress(const LaneShaderContext& context)
         {
-            float saved_float;
-            vec2 saved_vec2;
-            vec3 saved_vec3;
-            vec4 saved_vec4;
-            mat4 saved_mat4;
-        };
+            return reinterpret_cast<const unsigned char*>(&context);
+        }
+
+        template <typename Program, typename T>
+        static size_t contextOffset(T Program::* varying_data)
+        {
+            static const Program probe;
+            return reinterpret_cast<const unsigned char*>(&(probe.*varying_data)) - contextAddress(probe);
+        }
 
     public:
-        Attribute(float* varying_data)
+        template <typename Program>
+        Attribute(float Program::* varying_data)
         {
             type = AttributeType::AttributeFloat;
-            varying_float = varying_data;
-            saved_float = 0.0f;
+            offset = contextOffset(varying_data);
         }
-        Attribute(vec2* varying_data)
+        template <typename Program>
+        Attribute(vec2 Program::* varying_data)
         {
             type = AttributeType::AttributeVec2;
-            varying_vec2 = varying_data;
-            saved_vec2 = vec2(0.0f, 0.0f);
+            offset = contextOffset(varying_data);
         }
-        Attribute(vec3* varying_data)
+        template <typename Program>
+        Attribute(vec3 Program::* varying_data)
         {
             type = AttributeType::AttributeVec3;
-            varying_vec3 = varying_data;
-            saved_vec3 = vec3(0.0f, 0.0f, 0.0f);
+            offset = contextOffset(varying_data);
         }
-        Attribute(vec4* varying_data)
+        template <typename Program>
+        Attribute(vec4 Program::* varying_data)
         {
             type = AttributeType::AttributeVec4;
-            varying_vec4 = varying_data;
-            saved_vec4 = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+            offset = contextOffset(varying_data);
         }
-        Attribute(mat4* varying_data)
+        template <typename Program>
+        Attribute(mat4 Program::* varying_data)
         {
             type = AttributeType::AttributeMat4;
-            varying_mat4 = varying_data;
-            saved_mat4 = mat4();
+            offset = contextOffset(varying_data);
         }
-        Attribute(const Attribute& other)
+        // Varyings of LaneShaderProgram, every component is BGFXShaderLanes::lane_count floats
+        template <typename Program>
+        Attribute(BGFXShaderLanes::vfloat Program::* varying_data)
         {
-            type = other.type;
-            switch (type)
-            {
-            case AttributeType::AttributeFloat:
-                varying_float = other.varying_float;
-                saved_float = other.saved_float;
-                break;
-            case AttributeType::AttributeVec2:
-                varying_vec2 = other.varying_vec2;
-                saved_vec2 = other.saved_vec2;
-                break;
-            case AttributeType::AttributeVec3:
-                varying_vec3 = other.varying_vec3;
-                saved_vec3 = other.saved_vec3;
-                break;
-            case AttributeType::AttributeVec4:
-                varying_vec4 = other.varying_vec4;
-                saved_vec4 = other.saved_vec4;
-                break;
-            case AttributeType::AttributeMat4:
-                varying_mat4 = other.varying_mat4;
-                saved_mat4 = other.saved_mat4;
-                break;
-            default:
-                assert(false);
-            }
+            type = AttributeType::AttributeFloat;
+            offset = contextOffset(varying_data);
+        }
+        template <typename Program>
+        Attribute(BGFXShaderLanes::vec2 Program::* varying_data)
+        {
+            type = AttributeType::AttributeVec2;
+            offset = contextOffset(varying_data);
+        }
+        template <typename Program>
+        Attribute(BGFXShaderLanes::vec3 Program::* varying_data)
+        {
+            type = AttributeType::AttributeVec3;
+            offset = contextOffset(varying_data);
+        }
+        template <typename Program>
+        Attribute(BGFXShaderLanes::vec4 Program::* varying_data)
+        {
+            type = AttributeType::AttributeVec4;
+            offset = contextOffset(varying_data);
         }
         size_t getAttributeSize() const
         {
@@ -151,119 +274,14 @@ namespace BGFXShaderCPUEmulator
             }
             return 0;
         }
-        void loadVaryingFromVertexBuffer(void* vertex_buffer) const
-        {
-            switch (type)
-            {
-            case AttributeType::AttributeFloat:
-                *varying_float = *static_cast<float*>(vertex_buffer);
-                break;
-            case AttributeType::AttributeVec2:
-                *varying_vec2 = *static_cast<vec2*>(vertex_buffer);
-                break;
-            case AttributeType::AttributeVec3:
-                *varying_vec3 = *static_cast<vec3*>(vertex_buffer);
-                break;
-            case AttributeType::AttributeVec4:
-                *varying_vec4 = *static_cast<vec4*>(vertex_buffer);
-                break;
-            case AttributeType::AttributeMat4:
-                *varying_mat4 = *static_cast<mat4*>(vertex_buffer);
-                break;
-            default:
-                assert(false);
-            }
-        }
-        void saveVarying()
-        {
-            switch (type)
-            {
-            case AttributeType::AttributeFloat:
-                saved_float = *varying_float;
-                break;
-            case AttributeType::AttributeVec2:
-                saved_vec2 = *varying_vec2;
-                break;
-            case AttributeType::AttributeVec3:
-                saved_vec3 = *varying_vec3;
-                break;
-            case AttributeType::AttributeVec4:
-                saved_vec4 = *varying_vec4;
-                break;
-            case AttributeType::AttributeMat4:
-                saved_mat4 = *varying_mat4;
-                break;
-            default:
-                assert(false);
-            }
-        }
-        void loadVarying() const
+        // All attribute types are tightly packed arrays of floats (of vfloats for LaneShaderProgram varyings)
+        size_t getComponentCount() const
         {
-            switch (type)
-            {
-            case AttributeType::AttributeFloat:
-                *varying_float = saved_float;
-                break;
-            case AttributeType::AttributeVec2:
-                *varying_vec2 = saved_vec2;
-                break;
-            case AttributeType::AttributeVec3:
-                *varying_vec3 = saved_vec3;
-                break;
-            case AttributeType::AttributeVec4:
-                *varying_vec4 = saved_vec4;
-                break;
-            case AttributeType::AttributeMat4:
-                *varying_mat4 = saved_mat4;
-                break;
-            default:
-                assert(false);
-            }
+            return getAttributeSize() / sizeof(float);
         }
-        Attribute interpolate(const Attribute& other, float a) const
+        size_t getOffset() const
         {
-            if (type != other.type)
-            {
-                std::cerr << "Attributes have different types!" << std::endl;
-            }
-            assert(type == other.type);
-
-            switch (type)
-            {
-            case AttributeType::AttributeFloat:
-            {
-                Attribute result_float(varying_float);
-                result_float.saved_float = mix(saved_float, other.saved_float, a);
-                return result_float;
-            }
-            case AttributeType::AttributeVec2:
-            {
-                Attribute result_vec2(varying_vec2);
-                result_vec2.saved_vec2 = mix(saved_vec2, other.saved_vec2, a);
-                return result_vec2;
-            }
-            case AttributeType::AttributeVec3:
-            {
-                Attribute result_vec3(varying_vec3);
-                result_vec3.saved_vec3 = mix(saved_vec3, other.saved_vec3, a);
-                return result_vec3;
-            }
-            case AttributeType::AttributeVec4:
-            {
-                Attribute result_vec4(varying_vec4);
-                result_vec4.saved_vec4 = mix(saved_vec4, other.saved_vec4, a);
-                return result_vec4;
-            }
-            case AttributeType::AttributeMat4:
-            {
-                //Attribute result_mat4(varying_mat4);
-                //result_mat4.saved_mat4 = mix(saved_mat4, other.saved_mat4, a);
-                //return result_mat4;
-            }
-            default:
-                assert(false);
-            }
-            return Attribute(varying_float);
+            return offset;
         }
     };
 
@@ -279,312 +297,2684 @@ namespace BGFXShaderCPUEmulator
             }
             return result;
         }
-        void loadVaryingFromVertexBuffer(void* vertex_buffer) const
+        size_t getComponentCount() const
         {
+            size_t result = 0;
             for (size_t i = 0; i < size(); ++i)
             {
-                this->operator[](i).loadVaryingFromVertexBuffer(vertex_buffer);
-                vertex_buffer = static_cast<unsigned char*>(vertex_buffer) + this->operator[](i).getAttributeSize();
+                result += this->operator[](i).getComponentCount();
             }
+            return result;
         }
-        void saveVarying()
+    };
+
+    // Storage type of a vertex attribute, as in bgfx::AttribType
+    enum class AttribType : unsigned char
+    {
+        Uint8,
+        Int16,
+        Half,
+        Float
+    };
+
+    inline float halfToFloat(uint16_t half)
+    {
+        const uint32_t sign = static_cast<uint32_t>(half & 0x8000u) << 16;
+        const uint32_t exponent = (half >> 10) & 0x1fu;
+        const uint32_t mantissa = half & 0x3ffu;
+        if (exponent == 0)
         {
-            for (size_t i = 0; i < size(); ++i)
+            const float value = std::ldexp(static_cast<float>(mantissa), -24); // Zero or denormal
+            return sign ? -value : value;
+        }
+        uint32_t bits;
+        if (exponent == 0x1fu)
+        {
+            bits = sign | 0x7f800000u | (mantissa << 13) | (mantissa ? 0x400000u : 0u); // Infinity or quiet NaN, as F16C gives
+        }
+        else
+        {
+            bits = sign | ((exponent + 112u) << 23) | (mantissa << 13);
+        }
+        float result;
+        std::memcpy(&result, &bits, sizeof(result));
+        return result;
+    }
+
+    // Rounds to nearest even, overflows to infinity
+    inline uint16_t halfFromFloat(float value)
+    {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        const uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000u);
+        const uint32_t exponent = (bits >> 23) & 0xffu;
+        uint32_t mantissa = bits & 0x7fffffu;
+        if (exponent == 0xffu)
+        {
+            return static_cast<uint16_t>(sign | 0x7c00u | (mantissa ? 0x200u : 0u));
+        }
+        const int half_exponent = static_cast<int>(exponent) - 112;
+        if (half_exponent >= 0x1f)
+        {
+            return static_cast<uint16_t>(sign | 0x7c00u);
+        }
+        int shift = 13;
+        if (half_exponent <= 0)
+        {
+            if (half_exponent < -10)
             {
-                this->operator[](i).saveVarying();
+                return sign;
             }
+            mantissa |= 0x800000u;
+            shift = 14 - half_exponent;
         }
-        void loadVarying() const
+        const uint32_t half_mantissa = mantissa >> shift;
+        const uint32_t rest = mantissa & ((1u << shift) - 1u);
+        const uint32_t halfway = 1u << (shift - 1);
+        uint32_t result = (half_exponent > 0 ? static_cast<uint32_t>(half_exponent) << 10 : 0u) + half_mantissa;
+        if (rest > halfway || (rest == halfway && (half_mantissa & 1u)))
         {
-            for (size_t i = 0; i < size(); ++i)
+            ++result; // May carry into the exponent, which is the correct rounding
+        }
+        return static_cast<uint16_t>(sign | result);
+    }
+
+    // Describes how the attributes of one vertex stream are stored, in the style of bgfx::VertexLayout:
+    //
+    // VertexLayout layout;
+    // layout.begin()
+    //     .add(&CubesProgram::a_position, 3, AttribType::Float)
+    //     .add(&CubesProgram::a_color0, 4, AttribType::Uint8, true)
+    //     .end();
+    //
+    // Components missing in the stream are set to 0, except for the fourth one which is set to 1.
+    class VertexLayout
+    {
+        struct Element
+        {
+            size_t context_offset;   // Offset of the attribute inside of ShaderContext
+            size_t context_count;    // Float component count of the attribute
+            size_t offset;           // Offset inside of the vertex
+            unsigned char count;     // Component count in the stream
+            AttribType type;
+            bool normalized;         // Integer types are mapped to [0, 1] (unsigned) or [-1, 1] (signed)
+        };
+
+        std::vector<Element> elements;
+        size_t stride;
+
+        static size_t getTypeSize(AttribType type)
+        {
+            switch (type)
             {
-                this->operator[](i).loadVarying();
+            case AttribType::Uint8:
+                return 1;
+            case AttribType::Int16:
+            case AttribType::Half:
+                return 2;
+            case AttribType::Float:
+                return 4;
+            default:
+                assert(false);
             }
+            return 0;
         }
-        Attributes interpolate(const Attributes& other, float a)
+
+        // Converts the components of the element to floats, the fast paths process all four components at once
+        static void decodeElement(const Element& element, const unsigned char* data, float* result)
         {
-            if (size() != other.size())
+            switch (element.type)
+            {
+            case AttribType::Uint8:
             {
-                std::cerr << "Attribute array must have the same size!" << std::endl;
+                uint32_t packed = 0;
+                std::memcpy(&packed, data, element.count);
+#if defined(BGFX_SHADER_SIMD_SSE)
+                const __m128i zero = _mm_setzero_si128();
+                const __m128i integers = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(static_cast<int>(packed)), zero), zero);
+                __m128 values = _mm_cvtepi32_ps(integers);
+                if (element.normalized)
+                {
+                    values = _mm_div_ps(values, _mm_set1_ps(255.0f));
+                }
+                _mm_storeu_ps(result, values);
+#else
+                for (int i = 0; i < 4; ++i)
+                {
+                    const float value = static_cast<float>((packed >> (8 * i)) & 0xffu);
+                    result[i] = element.normalized ? value / 255.0f : value;
+                }
+#endif
+                break;
             }
-            assert(size() == other.size());
-
-            Attributes result;
-            for (size_t i = 0; i < size(); ++i)
+            case AttribType::Int16:
             {
-                result.push_back(this->operator[](i).interpolate(other[i], a));
+                int16_t packed[4] = { 0, 0, 0, 0 };
+                std::memcpy(packed, data, element.count * sizeof(int16_t));
+#if defined(BGFX_SHADER_SIMD_SSE)
+                const __m128i shorts = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(packed));
+                const __m128i integers = _mm_srai_epi32(_mm_unpacklo_epi16(shorts, shorts), 16);
+                __m128 values = _mm_cvtepi32_ps(integers);
+                if (element.normalized)
+                {
+                    values = _mm_max_ps(_mm_div_ps(values, _mm_set1_ps(32767.0f)), _mm_set1_ps(-1.0f));
+                }
+                _mm_storeu_ps(result, values);
+#else
+                for (int i = 0; i < 4; ++i)
+                {
+                    const float value = static_cast<float>(packed[i]);
+                    result[i] = element.normalized ? std::max(value / 32767.0f, -1.0f) : value;
+                }
+#endif
+                break;
+            }
+            case AttribType::Half:
+            {
+                uint16_t packed[4] = { 0, 0, 0, 0 };
+                std::memcpy(packed, data, element.count * sizeof(uint16_t));
+#if defined(BGFX_SHADER_SIMD_SSE) && defined(__F16C__)
+                _mm_storeu_ps(result, _mm_cvtph_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(packed))));
+#else
+                for (int i = 0; i < 4; ++i)
+                {
+                    result[i] = halfToFloat(packed[i]);
+                }
+#endif
+                break;
+            }
+            case AttribType::Float:
+                std::memcpy(result, data, element.count * sizeof(float));
+                break;
+            default:
+                assert(false);
             }
-            return result;
         }
-    };
-
-    class CPURendering
-    {
-        void* vertex_buffer;
-        size_t vertex_count;
-        uint16_t* index_buffer;
-        size_t triangle_count;
 
-        const size_t width;
-        const size_t height;
-        const size_t size;
-        std::vector<unsigned char> rgba_buffer;
-        std::vector<float> z_buffer;
-        size_t vertex_size;
+    public:
+        VertexLayout() : stride(0)
+        {
+        }
 
-        static float sign(vec2 p1, vec2 p2, vec2 p3)
+        VertexLayout& begin()
         {
-            return (p1.x - p3.x) * (p2.y - p3.y) - (p2.x - p3.x) * (p1.y - p3.y);
+            elements.clear();
+            stride = 0;
+            return *this;
         }
 
-        static bool pointInTriangle(vec2 pt, vec2 v1, vec2 v2, vec2 v3)
+        // Integer and half float attributes have 1 to 4 components, float ones up to the attribute size
+        VertexLayout& add(const Attribute& attribute, unsigned char count, AttribType type, bool normalized = false)
         {
-            float d1, d2, d3;
-            bool has_neg, has_pos;
+            const size_t max_count = type == AttribType::Float ? attribute.getComponentCount() : std::min<size_t>(4, attribute.getComponentCount());
+            if (count == 0 || count > max_count)
+            {
+                std::cerr << "Wrong component count " << static_cast<int>(count) << " of vertex attribute" << std::endl;
+                assert(false);
+                return *this;
+            }
+            Element element;
+            element.context_offset = attribute.getOffset();
+            element.context_count = attribute.getComponentCount();
+            element.offset = stride;
+            element.count = count;
+            element.type = type;
+            element.normalized = normalized && type != AttribType::Float && type != AttribType::Half;
+            elements.push_back(element);
+            stride += count * getTypeSize(type);
+            return *this;
+        }
 
-            d1 = sign(pt, v1, v2);
-            d2 = sign(pt, v2, v3);
-            d3 = sign(pt, v3, v1);
+        // Skips padding or data not used by the shader
+        VertexLayout& skip(size_t bytes)
+        {
+            stride += bytes;
+            return *this;
+        }
 
-            has_neg = (d1 < 0) || (d2 < 0) || (d3 < 0);
-            has_pos = (d1 > 0) || (d2 > 0) || (d3 > 0);
+        void end()
+        {
+        }
 
-            return !(has_neg && has_pos);
+        bool empty() const
+        {
+            return elements.empty();
         }
 
-        int xToScreen(int x) const
+        size_t getStride() const
         {
-            return static_cast<int>(x + width / 2);
+            return stride;
         }
 
-        int yToScreen(int y) const
+        // Tightly packed float attributes in the given order, the layout used by CPURendering::input_attributes
+        static VertexLayout fromAttributes(const Attributes& attributes)
         {
-            return static_cast<int>(y + height / 2);
+            VertexLayout layout;
+            layout.begin();
+            for (size_t i = 0; i < attributes.size(); ++i)
+            {
+                layout.add(attributes[i], static_cast<unsigned char>(attributes[i].getComponentCount()), AttribType::Float);
+            }
+            layout.end();
+            return layout;
         }
 
-        bool insideScreen(int x, int y) const
+        // Loads the attributes of the vertex into the shader context
+        void decode(ShaderContext& context, const unsigned char* vertex) const
         {
-            return x >= 0 && static_cast<size_t>(x) < width&& y >= 0 && static_cast<size_t>(y) < height;
+            unsigned char* context_data = reinterpret_cast<unsigned char*>(&context);
+            for (size_t i = 0; i < elements.size(); ++i)
+            {
+                const Element& element = elements[i];
+                float* target = reinterpret_cast<float*>(context_data + element.context_offset);
+                if (element.type == AttribType::Float)
+                {
+                    std::memcpy(target, vertex + element.offset, element.count * sizeof(float));
+                }
+                else
+                {
+                    float values[4];
+                    decodeElement(element, vertex + element.offset, values);
+                    std::memcpy(target, values, element.count * sizeof(float));
+                }
+                for (size_t component = element.count; component < element.context_count; ++component)
+                {
+                    target[component] = component == 3 ? 1.0f : 0.0f;
+                }
+            }
         }
+    };
 
-        unsigned char rBuffer(int x, int y) const
+    // Structure-of-arrays vertex shader output of one draw.
+    // Streams 0-3 are gl_Position.x, .y, .z and .w, then every component of every output attribute has its own stream.
+    // A stream holds one float per shaded vertex: every vertex referenced by the draw, once per instance.
+    class PostTransformBuffer
+    {
+        size_t vertex_count;
+        std::vector<size_t> varying_offsets;
+        std::vector<float> streams;
+
+    public:
+        static const size_t position_stream_count = 4;
+
+        PostTransformBuffer() : vertex_count(0)
         {
-            return rgba_buffer[(width * y + x) * 4 + 0];
         }
 
-        unsigned char gBuffer(int x, int y) const
+        void reset(size_t vertex_count_, const Attributes& output_attributes)
         {
-            return rgba_buffer[(width * y + x) * 4 + 1];
+            vertex_count = vertex_count_;
+            varying_offsets.clear();
+            for (size_t i = 0; i < output_attributes.size(); ++i)
+            {
+                for (size_t component = 0; component < output_attributes[i].getComponentCount(); ++component)
+                {
+                    varying_offsets.push_back(output_attributes[i].getOffset() + component * sizeof(float));
+                }
+            }
+            streams.resize(getStreamCount() * vertex_count);
         }
 
-        unsigned char bBuffer(int x, int y) const
+        size_t getVertexCount() const
         {
-            return rgba_buffer[(width * y + x) * 4 + 2];
+            return vertex_count;
         }
 
-        unsigned char aBuffer(int x, int y) const
+        size_t getStreamCount() const
         {
-            return rgba_buffer[(width * y + x) * 4 + 3];
+            return position_stream_count + varying_offsets.size();
         }
 
-        unsigned char& rBuffer(int x, int y)
+        size_t getVaryingStreamCount() const
         {
-            return rgba_buffer[(width * y + x) * 4 + 0];
+            return varying_offsets.size();
         }
 
-        unsigned char& gBuffer(int x, int y)
+        // Offset inside of ShaderContext of the float stored by the varying stream
+        size_t getVaryingOffset(size_t varying_stream) const
         {
-            return rgba_buffer[(width * y + x) * 4 + 1];
+            return varying_offsets[varying_stream];
         }
 
-        unsigned char& bBuffer(int x, int y)
+        float* getStream(size_t stream)
         {
-            return rgba_buffer[(width * y + x) * 4 + 2];
+            return streams.data() + stream * vertex_count;
         }
 
-        unsigned char& aBuffer(int x, int y)
+        const float* getStream(size_t stream) const
         {
-            return rgba_buffer[(width * y + x) * 4 + 3];
+            return streams.data() + stream * vertex_count;
         }
 
-        float zBuffer(int x, int y) const
+        const float* getVaryingStream(size_t varying_stream) const
         {
-            return z_buffer[width * y + x];
+            return getStream(position_stream_count + varying_stream);
         }
 
-        float& zBuffer(int x, int y)
+        vec4 getPosition(size_t vertex) const
         {
-            return z_buffer[width * y + x];
+            return vec4(getStream(0)[vertex], getStream(1)[vertex], getStream(2)[vertex], getStream(3)[vertex]);
         }
 
-        void processVertex(uint16_t index, Attributes& vertex_output_attributes, vec4& saved_gl_position)
+        // Stores gl_Position and the output varyings of the shaded vertex
+        void save(const ShaderContext& context, size_t vertex)
         {
-            if (index >= vertex_count)
+            getStream(0)[vertex] = context.gl_Position.x;
+            getStream(1)[vertex] = context.gl_Position.y;
+            getStream(2)[vertex] = context.gl_Position.z;
+            getStream(3)[vertex] = context.gl_Position.w;
+            const unsigned char* context_data = reinterpret_cast<const unsigned char*>(&context);
+            for (size_t i = 0; i < varying_offsets.size(); ++i)
             {
-                std::cerr << "Out of vertex index " << index << std::endl;
-                return;
+                getStream(position_stream_count + i)[vertex] = *reinterpret_cast<const float*>(context_data + varying_offsets[i]);
             }
-            void* vertex_buffer_attributes = static_cast<unsigned char*>(vertex_buffer) + vertex_size * index;
-            input_attributes.loadVaryingFromVertexBuffer(vertex_buffer_attributes);
-            vertex_shader_main(); // Call vertex shader for the triangle first vertex
-            saved_gl_position = gl_Position; // Save output vertex
-            output_attributes.saveVarying(); // Save vertex shader output variables
-            vertex_output_attributes = output_attributes;
+        }
+    };
+
+    enum class RenderMode : unsigned char
+    {
+        Immediate, // Triangles are rasterized one by one on the calling thread
+        Tiled      // Triangles are binned into screen tiles, tiles are rasterized in parallel
+    };
+
+    // Depth buffer formats, depth is stored in the [0, 1] window range
+    enum class DepthFormat : unsigned char
+    {
+        D16,  // 16-bit normalized integer
+        D24,  // 24-bit normalized integer, stored in 32 bits
+        D32F  // 32-bit float
+    };
+
+    enum class ShadingMode : unsigned char
+    {
+        Forward,         // Fragments are shaded as soon as they pass the depth test
+        VisibilityBuffer // Depth and triangle of every pixel are rasterized for all draws of render() or frame() first,
+                         // then every visible pixel is shaded once
+    };
+
+    // Winding of the triangles to cull, in window coordinates
+    enum class CullMode : unsigned char
+    {
+        None,
+        Clockwise,
+        CounterClockwise
+    };
+
+    // Triangles rejected before rasterization during the last render(), by test
+    struct CullStats
+    {
+        size_t frustum;   // Outside of the view frustum
+        size_t zero_area; // No area in window coordinates, after snapping to the subpixel grid
+        size_t back_face; // Winding culled by the cull mode
+    };
+
+    // Counters and timings of the last render() or frame(), like bgfx::Stats. Threads count into their own
+    // WorkerContext without synchronization, the counters are summed at the end of every draw.
+    // Stage times are in nanoseconds, summed over the threads running the stage, so in RenderMode::Tiled
+    // they may add up to more than frame_ns.
+    struct Stats
+    {
+        size_t draw_count;
+        size_t vertex_shader_invocations;
+        size_t triangles_submitted;  // Triangles of the draw ranges, times the instance count
+        size_t triangles_culled;     // Sum of CullStats
+        size_t triangles_rasterized; // Triangles set up for rasterization, clipping may split a triangle in several
+        size_t pixels_tested;        // Covered pixels reaching the depth test
+        size_t pixels_depth_passed;
+        size_t fragment_shader_invocations; // Pixels shaded, pixels of a lane shader call are counted one by one
+        size_t quad_record_invocations;     // Extra scalar fragment shader runs for texture mips, see ShaderContext::texture2D
+        uint64_t vertex_ns;
+        uint64_t setup_ns;  // Clipping, culling, setup and binning of triangles
+        uint64_t raster_ns; // Rasterization and depth test, including the fragment shader in ShadingMode::Forward
+        uint64_t shade_ns;  // Fragment shader of ShadingMode::VisibilityBuffer
+        uint64_t output_ns; // readPixels(), saveToPPM() and saveToPNG() since the last render() or frame()
+        uint64_t frame_ns;  // Wall time of render() or frame()
+    };
+
+    class CPURendering
+    {
+    public:
+        static const size_t max_vertex_streams = 4;
+
+    private:
+        struct VertexStream
+        {
+            const unsigned char* data;
+            size_t vertex_count;
+            VertexLayout layout; // Empty for the stream of setVertexBuffer(void*, size_t), which uses input_attributes
+        };
+
+        VertexStream vertex_streams[max_vertex_streams];
+        size_t vertex_count; // Vertices available in all streams of the draw
+        VertexLayout input_attributes_layout;
+
+        // Draw range: triangle_count triangles from first_index, base_vertex is added to every index
+        const void* index_buffer;
+        bool index_buffer32; // uint32_t indices, uint16_t otherwise
+        size_t first_index;
+        size_t triangle_count;
+        int base_vertex;
+
+        // Per instance attributes, the draw is repeated instance_count times when set
+        const unsigned char* instance_data;
+        size_t instance_count;
+        VertexLayout instance_layout;
+
+        // Color, depth and visibility buffers are stored in block_size x block_size blocks of consecutive pixels,
+        // pixels are row-major inside of a block and blocks are row-major in the framebuffer
+        const size_t width;
+        const size_t height;
+        const size_t blocks_x; // Blocks in a row of the framebuffer
+        const size_t size;     // Pixels in the buffers, including the padding of the partial blocks at the edges
+        std::vector<unsigned char> rgba_buffer;
+        const DepthFormat depth_format;
+        std::vector<uint16_t> depth_buffer16; // DepthFormat::D16
+        std::vector<uint32_t> depth_buffer32; // DepthFormat::D24 and DepthFormat::D32F
+        std::vector<uint32_t> hi_z_buffer; // Farthest depth of every block_size x block_size block of the depth buffer
+        bool use_hi_z; // Blocks of the draw are never shared by two threads
+
+        ShadingMode shading_mode;
+        std::vector<uint32_t> visibility_buffer; // Index in triangles of the nearest triangle of every pixel, or no_triangle
+        static const uint32_t no_triangle = 0xffffffff;
+        const ShaderContext* program;
+        const LaneShaderContext* lane_program;
+
+        RenderMode render_mode;
+        size_t tile_size;
+        size_t thread_count;
+        mutable std::unique_ptr<ThreadPool> thread_pool; // See getThreadPool()
+
+        // Viewport and scissor rectangles in window coordinates, the origin is the bottom left corner
+        int view_x, view_y;
+        unsigned view_width, view_height;
+        int scissor_x, scissor_y;
+        unsigned scissor_width, scissor_height; // Zero size disables the scissor test
+
+        // Pixels written by the draw: the viewport inside of the scissor rectangle and the framebuffer, inclusive
+        int clip_min_x, clip_min_y, clip_max_x, clip_max_y;
+
+        CullMode cull_mode;
+        CullStats cull_stats;
+        Stats stats; // Without triangles_culled and output_ns, see getStats()
+        mutable uint64_t output_ns;
+
+        // Nanoseconds of a monotonic clock
+        static uint64_t getTime()
+        {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+        }
+
+#if defined(BGFX_SHADER_TRACE)
+        std::unique_ptr<Trace> trace;
+        bool tracing;
+
+        // Buffer 0 for the thread calling render() or frame(), 1 + i for worker i, null when not tracing
+        TraceBuffer* getTraceBuffer(size_t thread_index) const
+        {
+            return tracing ? trace->getBuffer(thread_index) : 0;
+        }
+#endif
+
+        // frameAsync() renders into framebuffer_count renderers of the same size in turn, on render_thread.
+        // Every one has its own thread pool, so a finished frame can be resolved while the next one renders.
+        size_t framebuffer_count;
+        size_t async_frame_count;
+        std::vector<std::unique_ptr<CPURendering>> framebuffers;
+        std::thread render_thread;
+        std::mutex render_mutex;
+        std::condition_variable render_wake_up;
+        std::deque<std::function<void()>> render_jobs;
+        bool render_stopping;
+
+        // Runs the jobs of frameAsync() in order, finishes the queued ones before stopping
+        void renderThreadMain()
+        {
+            for (;;)
+            {
+                std::function<void()> job;
+                {
+                    std::unique_lock<std::mutex> lock(render_mutex);
+                    render_wake_up.wait(lock, [&] { return render_stopping || !render_jobs.empty(); });
+                    if (render_jobs.empty())
+                    {
+                        return;
+                    }
+                    job = std::move(render_jobs.front());
+                    render_jobs.pop_front();
+                }
+                job();
+            }
+        }
+
+        // Waits until every frame of frameAsync() is finished
+        void finishAsyncFrames()
+        {
+            if (!render_thread.joinable())
+            {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(render_mutex);
+                render_stopping = true;
+            }
+            render_wake_up.notify_all();
+            render_thread.join();
+            render_stopping = false;
+        }
+
+        size_t pixelIndex(int x, int y) const
+        {
+            const unsigned block_x = static_cast<unsigned>(x) / block_size;
+            const unsigned block_y = static_cast<unsigned>(y) / block_size;
+            const unsigned pixel_x = static_cast<unsigned>(x) % block_size;
+            const unsigned pixel_y = static_cast<unsigned>(y) % block_size;
+            return (block_y * blocks_x + block_x) * (block_size * block_size) + pixel_y * block_size + pixel_x;
+        }
+
+        unsigned char& rBuffer(int x, int y)
+        {
+            return rgba_buffer[pixelIndex(x, y) * 4 + 0];
+        }
+
+        unsigned char& gBuffer(int x, int y)
+        {
+            return rgba_buffer[pixelIndex(x, y) * 4 + 1];
+        }
+
+        unsigned char& bBuffer(int x, int y)
+        {
+            return rgba_buffer[pixelIndex(x, y) * 4 + 2];
+        }
+
+        unsigned char& aBuffer(int x, int y)
+        {
+            return rgba_buffer[pixelIndex(x, y) * 4 + 3];
+        }
+
+        // Depth in [0, 1] as stored by the depth format. Stored values compare as the depths they represent,
+        // for DepthFormat::D32F the bits of a non-negative float are used.
+        uint32_t toDepthValue(float depth) const
+        {
+            depth = depth > 0.0f ? (depth < 1.0f ? depth : 1.0f) : 0.0f;
+            switch (depth_format)
+            {
+            case DepthFormat::D16:
+                return static_cast<uint32_t>(depth * 65535.0f + 0.5f);
+            case DepthFormat::D24:
+                return static_cast<uint32_t>(static_cast<double>(depth) * 16777215.0 + 0.5);
+            default:
+                uint32_t bits;
+                std::memcpy(&bits, &depth, sizeof(bits));
+                return bits;
+            }
+        }
+
+        uint32_t loadDepth(int x, int y) const
+        {
+            return depth_format == DepthFormat::D16 ? depth_buffer16[pixelIndex(x, y)] : depth_buffer32[pixelIndex(x, y)];
+        }
+
+        void storeDepth(int x, int y, uint32_t depth)
+        {
+            if (depth_format == DepthFormat::D16)
+            {
+                depth_buffer16[pixelIndex(x, y)] = static_cast<uint16_t>(depth);
+            }
+            else
+            {
+                depth_buffer32[pixelIndex(x, y)] = depth;
+            }
+        }
+
+        uint32_t& visibilityBuffer(int x, int y)
+        {
+            return visibility_buffer[pixelIndex(x, y)];
+        }
+
+        uint32_t& hiZBuffer(int x, int y)
+        {
+            return hi_z_buffer[blocks_x * (y / block_size) + x / block_size];
+        }
+
+        // Shader state owned by one thread of render()
+        struct WorkerContext
+        {
+            std::unique_ptr<ShaderContext> context;
+            std::unique_ptr<LaneShaderContext> lane_context;
+            std::vector<float> plane_values; // Current value of every interpolation plane while walking a row
+            std::vector<float> quad_values; // Plane values of the quad pixels, see ShaderContext::texture2D
+            bool quad_textures; // The fragment shader samples textures, pixels are shaded after recording their quad
+            Stats stats; // Pixel counters and stage times of the thread during the draw
+            // Layout of the draw's varyings, kept with the contexts for the shading of ShadingMode::VisibilityBuffer
+            size_t plane_count; // See getPlaneCount()
+            std::vector<size_t> varying_offsets; // Offsets inside of ShaderContext of the varying streams
+            std::vector<size_t> lane_varying_offsets; // Offsets inside of LaneShaderContext of the varying streams
+        };
+
+        static const size_t vertex_chunk_size = 256;
+
+        PostTransformBuffer post_transform_buffer;
+        std::vector<uint32_t> referenced_vertices; // Vertices used by the draw range, in vertex order
+        std::vector<uint32_t> vertex_slots; // Index in referenced_vertices of every vertex, or no_vertex
+        static const uint32_t no_vertex = 0xffffffff;
+
+        size_t getDrawInstanceCount() const
+        {
+            return instance_data ? instance_count : 1;
+        }
+
+        // Vertex of the i-th index of the draw range, may be out of the vertex buffer
+        int64_t getVertex(size_t i) const
+        {
+            const size_t index = index_buffer32 ? static_cast<const uint32_t*>(index_buffer)[first_index + i] :
+                static_cast<const uint16_t*>(index_buffer)[first_index + i];
+            return static_cast<int64_t>(index) + base_vertex;
+        }
+
+        void shadeVertex(ShaderContext& context, size_t index, size_t shaded_vertex)
+        {
+            for (size_t stream = 0; stream < max_vertex_streams; ++stream)
+            {
+                const VertexStream& vertex_stream = vertex_streams[stream];
+                if (vertex_stream.data)
+                {
+                    const VertexLayout& layout = vertex_stream.layout.empty() ? input_attributes_layout : vertex_stream.layout;
+                    layout.decode(context, vertex_stream.data + layout.getStride() * index);
+                }
+            }
+            context.vertex_shader_main(); // Call vertex shader for the vertex
+            post_transform_buffer.save(context, shaded_vertex); // Save output vertex and vertex shader output variables
+        }
+
+        // Shades vertices [first, last) of the instance major sequence of all referenced vertices of all instances.
+        // Instance attributes are decoded once per instance of the range, vertex attributes never overwrite them.
+        void shadeVertices(ShaderContext& context, size_t first, size_t last)
+        {
+            const size_t referenced_count = referenced_vertices.size();
+            for (size_t shaded_vertex = first; shaded_vertex < last; ++shaded_vertex)
+            {
+                const size_t slot = shaded_vertex % referenced_count;
+                if (instance_data && (slot == 0 || shaded_vertex == first))
+                {
+                    instance_layout.decode(context, instance_data + instance_layout.getStride() * (shaded_vertex / referenced_count));
+                }
+                shadeVertex(context, referenced_vertices[slot], shaded_vertex);
+            }
+        }
+
+        // Vertex stage: every vertex referenced by the draw range is shaded exactly once per instance into
+        // post_transform_buffer. With a thread pool the vertices are shaded in parallel chunks, one shader context
+        // per worker, chunks run across instance boundaries so small meshes still make full chunks.
+        void processVertices(std::vector<WorkerContext>& workers, ThreadPool* pool)
+        {
+            BGFX_SHADER_TRACE_SCOPE(getTraceBuffer(0), "vertex", -1);
+            const uint64_t start_time = getTime();
+            vertex_slots.assign(vertex_count, uint32_t(no_vertex));
+            for (size_t i = 0; i < triangle_count * 3; ++i)
+            {
+                const int64_t vertex = getVertex(i);
+                if (vertex >= 0 && vertex < static_cast<int64_t>(vertex_count))
+                {
+                    vertex_slots[static_cast<size_t>(vertex)] = 0;
+                }
+            }
+            referenced_vertices.clear();
+            for (size_t index = 0; index < vertex_count; ++index)
+            {
+                if (vertex_slots[index] != no_vertex)
+                {
+                    vertex_slots[index] = static_cast<uint32_t>(referenced_vertices.size());
+                    referenced_vertices.push_back(static_cast<uint32_t>(index));
+                }
+            }
+
+            const size_t shaded_count = referenced_vertices.size() * getDrawInstanceCount();
+            post_transform_buffer.reset(shaded_count, output_attributes);
+            stats.vertex_shader_invocations += shaded_count;
+
+            if (!pool)
+            {
+                shadeVertices(*workers[0].context, 0, shaded_count);
+                stats.vertex_ns += getTime() - start_time;
+                return;
+            }
+            stats.vertex_ns += getTime() - start_time;
+
+            const size_t chunk_count = (shaded_count + vertex_chunk_size - 1) / vertex_chunk_size;
+            pool->run(chunk_count, [&](size_t chunk_index, size_t worker_index)
+            {
+                BGFX_SHADER_TRACE_SCOPE(getTraceBuffer(1 + worker_index), "vertex chunk", static_cast<int64_t>(chunk_index));
+                const uint64_t chunk_start_time = getTime();
+                const size_t first = chunk_index * vertex_chunk_size;
+                shadeVertices(*workers[worker_index].context, first, std::min(first + vertex_chunk_size, shaded_count));
+                workers[worker_index].stats.vertex_ns += getTime() - chunk_start_time;
+            });
+        }
+
+        void setDrawRange(const void* index_buffer_, bool index_buffer32_, size_t first_index_, size_t index_count, int base_vertex_)
+        {
+            if (index_count % 3)
+            {
+                std::cerr << "Index count " << index_count << " is not a multiple of 3" << std::endl;
+                assert(false);
+                return;
+            }
+            index_buffer = index_buffer_;
+            index_buffer32 = index_buffer32_;
+            first_index = first_index_;
+            triangle_count = index_count / 3;
+            base_vertex = base_vertex_;
+        }
+
+        // Vertex positions are snapped to 1/256 of a pixel, so edge functions are exact 64-bit integers
+        // and stepping them incrementally gives the same values as evaluating them directly
+        static const int subpixel_bits = 8;
+        static const int64_t fixed_one = int64_t(1) << subpixel_bits;
+
+        static int64_t toFixed(float x)
+        {
+            return static_cast<int64_t>(std::floor(x * static_cast<float>(1 << subpixel_bits) + 0.5f));
+        }
+
+        // Largest integer n with n <= fixed / 2^subpixel_bits
+        static int64_t floorFixed(int64_t fixed)
+        {
+            return fixed >> subpixel_bits;
+        }
+
+        // Smallest integer n with n >= fixed / 2^subpixel_bits
+        static int64_t ceilFixed(int64_t fixed)
+        {
+            return -((-fixed) >> subpixel_bits);
+        }
+
+        // E(x, y) = a * x + b * y + c for fixed point x and y, positive inside of the triangle
+        struct EdgeFunction
+        {
+            int64_t a, b, c;
+
+            void setup(int64_t x0, int64_t y0, int64_t x1, int64_t y1)
+            {
+                a = y0 - y1;
+                b = x1 - x0;
+                c = x0 * y1 - y0 * x1;
+            }
+
+            int64_t evaluate(int64_t x, int64_t y) const
+            {
+                return a * x + b * y + c;
+            }
+
+            // Top-left fill rule, for edges made positive inside: samples exactly on an edge are covered only on top
+            // and left edges, so samples on the edge shared by two triangles are covered once. The window y axis
+            // points up, so the inside of a top edge is below it. Coverage tests stay E(x, y) >= 0.
+            void applyFillRule()
+            {
+                if (!(a > 0 || (a == 0 && b < 0)))
+                {
+                    c -= 1;
+                }
+            }
+        };
+
+        // V(x, y) = a * x + b * y + c for window x and y, interpolates a per vertex value over the triangle
+        struct InterpolationPlane
+        {
+            float a, b, c;
+
+            float evaluate(float x, float y) const
+            {
+                return a * x + b * y + c;
+            }
+        };
+
+        // Window depth, 1 / w, then varying / w for every varying stream, so varyings are interpolated perspective correct
+        size_t getPlaneCount() const
+        {
+            return 2 + post_transform_buffer.getVaryingStreamCount();
+        }
+
+        // Post-transform triangle, ready for rasterization
+        struct Triangle
+        {
+            // edges[i] is the edge opposite to vertex i, its value divided by the area is the barycentric coordinate of vertex i
+            EdgeFunction edges[3];
+            size_t first_plane; // getPlaneCount() planes in triangle_planes
+            uint32_t draw; // Index in visibility_draws of the draw of the triangle
+            // Bounding box of the covered pixels, not clipped
+            int min_x, min_y, max_x, max_y;
+        };
+
+        std::vector<Triangle> triangles; // Triangles being rasterized, all triangles of the frame in ShadingMode::VisibilityBuffer
+        std::vector<InterpolationPlane> triangle_planes; // Planes of the triangles being rasterized
+
+        // ShadingMode::VisibilityBuffer: shading contexts of every draw of the frame, one per thread, and the union of
+        // the clip rectangles of the draws
+        std::vector<std::vector<WorkerContext>> visibility_draws;
+        int visible_min_x, visible_min_y, visible_max_x, visible_max_y;
+
+        const InterpolationPlane* getPlanes(const Triangle& triangle) const
+        {
+            return triangle_planes.data() + triangle.first_plane;
+        }
+
+        // Pixel centers are sampled, at half integer window coordinates
+        static int64_t sampleToFixed(int pixel)
+        {
+            return static_cast<int64_t>(pixel) * fixed_one + fixed_one / 2;
+        }
+
+        static float sampleCoordinate(int pixel)
+        {
+            return static_cast<float>(pixel) + 0.5f;
+        }
+
+        // Plane through the values at the triangle vertices, computed from the exact edge functions
+        static void setupPlane(const Triangle& triangle, double inv_area, const double values[3], InterpolationPlane& plane)
+        {
+            double a = 0.0;
+            double b = 0.0;
+            double c = 0.0;
+            for (int i = 0; i < 3; ++i)
+            {
+                a += values[i] * static_cast<double>(triangle.edges[i].a);
+                b += values[i] * static_cast<double>(triangle.edges[i].b);
+                c += values[i] * static_cast<double>(triangle.edges[i].c);
+            }
+            plane.a = static_cast<float>(a * static_cast<double>(fixed_one) * inv_area);
+            plane.b = static_cast<float>(b * static_cast<double>(fixed_one) * inv_area);
+            plane.c = static_cast<float>(c * inv_area);
+        }
+
+        // Window coordinates are kept inside of [-guard_band, guard_band] by clipping, which bounds the fixed point
+        // edge functions. Triangles crossing the viewport edges inside of the guard band are not clipped, the
+        // rasterizer only visits the pixels of the clip rectangle.
+        static const int guard_band = 1 << 14;
+
+        // Clip planes: near, far, then the guard band left, right, bottom and top
+        static const int clip_plane_count = 6;
+
+        // Guard band in normalized device coordinates, for the current viewport
+        float guard_band_min_x, guard_band_max_x, guard_band_min_y, guard_band_max_y;
+
+        // Vertex of a triangle clipped in clip space: its position and weights of the original triangle vertices
+        struct ClipVertex
+        {
+            vec4 position;
+            float weights[3];
+        };
+
+        // Positive inside of the plane
+        float clipDistance(const vec4& position, int plane) const
+        {
+            switch (plane)
+            {
+            case 0:
+                return position.z + position.w;
+            case 1:
+                return position.w - position.z;
+            case 2:
+                return position.x - guard_band_min_x * position.w;
+            case 3:
+                return guard_band_max_x * position.w - position.x;
+            case 4:
+                return position.y - guard_band_min_y * position.w;
+            default:
+                return guard_band_max_y * position.w - position.y;
+            }
+        }
+
+        unsigned clipCode(const vec4& position) const
+        {
+            unsigned code = 0;
+            for (int plane = 0; plane < clip_plane_count; ++plane)
+            {
+                if (clipDistance(position, plane) < 0.0f)
+                {
+                    code |= 1u << plane;
+                }
+            }
+            return code;
+        }
+
+        // Planes of the view frustum the position is outside of: left, right, bottom, top, near and far
+        static unsigned frustumCode(const vec4& position)
+        {
+            return (position.x < -position.w ? 1u : 0u) | (position.x > position.w ? 2u : 0u) |
+                (position.y < -position.w ? 4u : 0u) | (position.y > position.w ? 8u : 0u) |
+                (position.z < -position.w ? 16u : 0u) | (position.z > position.w ? 32u : 0u);
+        }
+
+        // Clipped vertex after the perspective divide and viewport transform
+        struct WindowVertex
+        {
+            int64_t x, y; // Fixed point
+            double depth, inv_w;
+            const float* weights;
+        };
+
+        bool toWindow(const ClipVertex& clip_vertex, WindowVertex& vertex) const
+        {
+            const vec4& position = clip_vertex.position;
+            if (!(position.w > 0.0f))
+            {
+                return false;
+            }
+            vertex.inv_w = 1.0 / static_cast<double>(position.w);
+            const float ndc_x = static_cast<float>(position.x * vertex.inv_w);
+            const float ndc_y = static_cast<float>(position.y * vertex.inv_w);
+            const float ndc_z = static_cast<float>(position.z * vertex.inv_w);
+            vertex.x = toFixed(static_cast<float>(view_x) + (ndc_x * 0.5f + 0.5f) * static_cast<float>(view_width));
+            vertex.y = toFixed(static_cast<float>(view_y) + (ndc_y * 0.5f + 0.5f) * static_cast<float>(view_height));
+            vertex.depth = ndc_z * 0.5f + 0.5f;
+            vertex.weights = clip_vertex.weights;
+            return true;
+        }
+
+        // Setup of one triangle, appended to triangles if it covers any sample
+        void setupTriangle(const size_t vertices[3], const WindowVertex& v0, const WindowVertex& v1, const WindowVertex& v2)
+        {
+            const WindowVertex* window_vertices[3] = { &v0, &v1, &v2 };
+            Triangle triangle;
+            triangle.edges[0].setup(v1.x, v1.y, v2.x, v2.y);
+            triangle.edges[1].setup(v2.x, v2.y, v0.x, v0.y);
+            triangle.edges[2].setup(v0.x, v0.y, v1.x, v1.y);
+            int64_t area = triangle.edges[2].evaluate(v2.x, v2.y);
+            if (area == 0)
+            {
+                return; // Sliver of a clipped polygon
+            }
+            if (area < 0)
+            {
+                // Both windings are rasterized, flip the edges so the inside is always positive
+                for (int i = 0; i < 3; ++i)
+                {
+                    triangle.edges[i].a = -triangle.edges[i].a;
+                    triangle.edges[i].b = -triangle.edges[i].b;
+                    triangle.edges[i].c = -triangle.edges[i].c;
+                }
+                area = -area;
+            }
+
+            triangle.min_x = static_cast<int>(ceilFixed(std::min(std::min(v0.x, v1.x), v2.x) - fixed_one / 2));
+            triangle.min_y = static_cast<int>(ceilFixed(std::min(std::min(v0.y, v1.y), v2.y) - fixed_one / 2));
+            triangle.max_x = static_cast<int>(floorFixed(std::max(std::max(v0.x, v1.x), v2.x) - fixed_one / 2));
+            triangle.max_y = static_cast<int>(floorFixed(std::max(std::max(v0.y, v1.y), v2.y) - fixed_one / 2));
+            if (triangle.min_x > triangle.max_x || triangle.min_y > triangle.max_y)
+            {
+                return;
+            }
+
+            const double inv_area = 1.0 / static_cast<double>(area);
+            triangle.first_plane = triangle_planes.size();
+            triangle.draw = static_cast<uint32_t>(visibility_draws.size());
+            triangle_planes.resize(triangle.first_plane + getPlaneCount());
+            InterpolationPlane* planes = triangle_planes.data() + triangle.first_plane;
+            const double depth[3] = { v0.depth, v1.depth, v2.depth };
+            const double inv_w[3] = { v0.inv_w, v1.inv_w, v2.inv_w };
+            setupPlane(triangle, inv_area, depth, planes[0]);
+            setupPlane(triangle, inv_area, inv_w, planes[1]);
+            for (size_t i = 0; i < post_transform_buffer.getVaryingStreamCount(); ++i)
+            {
+                const float* stream = post_transform_buffer.getVaryingStream(i);
+                double values[3];
+                for (int vertex = 0; vertex < 3; ++vertex)
+                {
+                    const float* weights = window_vertices[vertex]->weights;
+                    const double value = weights[0] * stream[vertices[0]] + weights[1] * stream[vertices[1]] + weights[2] * stream[vertices[2]];
+                    values[vertex] = value * inv_w[vertex];
+                }
+                setupPlane(triangle, inv_area, values, planes[2 + i]);
+            }
+            // After the planes, which interpolate from the exact edge functions
+            for (int i = 0; i < 3; ++i)
+            {
+                triangle.edges[i].applyFillRule();
+            }
+            triangles.push_back(triangle);
+        }
+
+        // Primitive assembly, culling, clipping and triangle setup, reads vertex stage results only.
+        // Appends the triangles to rasterize to triangles, and their planes to triangle_planes.
+        void setupTriangles(size_t triangle_index)
+        {
+            size_t vertices[3];
+            ClipVertex clip_vertices[3];
+            unsigned clip_codes[3];
+            unsigned frustum_codes[3];
+            // Triangles are numbered instance by instance
+            const size_t instance = triangle_index / triangle_count;
+            const size_t instance_triangle = triangle_index % triangle_count;
+            for (int i = 0; i < 3; ++i)
+            {
+                const int64_t vertex = getVertex(instance_triangle * 3 + i);
+                if (vertex < 0 || vertex >= static_cast<int64_t>(vertex_count))
+                {
+                    std::cerr << "Out of vertex index " << vertex << std::endl;
+                    return;
+                }
+                vertices[i] = instance * referenced_vertices.size() + vertex_slots[static_cast<size_t>(vertex)];
+                clip_vertices[i].position = post_transform_buffer.getPosition(vertices[i]);
+                for (int j = 0; j < 3; ++j)
+                {
+                    clip_vertices[i].weights[j] = i == j ? 1.0f : 0.0f;
+                }
+                clip_codes[i] = clipCode(clip_vertices[i].position);
+                frustum_codes[i] = frustumCode(clip_vertices[i].position);
+            }
+
+            if (frustum_codes[0] & frustum_codes[1] & frustum_codes[2])
+            {
+                ++cull_stats.frustum; // All vertices are outside of the same plane
+                return;
+            }
+
+            // Sutherland-Hodgman clipping against the planes crossed by the triangle
+            const unsigned crossed_planes = clip_codes[0] | clip_codes[1] | clip_codes[2];
+            ClipVertex polygons[2][3 + clip_plane_count];
+            size_t polygon_size = 3;
+            int current = 0;
+            std::copy(clip_vertices, clip_vertices + 3, polygons[current]);
+            for (int plane = 0; plane < clip_plane_count && polygon_size >= 3; ++plane)
+            {
+                if (!(crossed_planes & (1u << plane)))
+                {
+                    continue;
+                }
+                const ClipVertex* input = polygons[current];
+                ClipVertex* output = polygons[1 - current];
+                size_t output_size = 0;
+                for (size_t i = 0; i < polygon_size; ++i)
+                {
+                    const ClipVertex& from = input[i];
+                    const ClipVertex& to = input[(i + 1) % polygon_size];
+                    const float from_distance = clipDistance(from.position, plane);
+                    const float to_distance = clipDistance(to.position, plane);
+                    if (from_distance >= 0.0f)
+                    {
+                        output[output_size++] = from;
+                    }
+                    if ((from_distance >= 0.0f) != (to_distance >= 0.0f))
+                    {
+                        const float t = from_distance / (from_distance - to_distance);
+                        ClipVertex& vertex = output[output_size++];
+                        vertex.position = from.position + (to.position - from.position) * t;
+                        for (int j = 0; j < 3; ++j)
+                        {
+                            vertex.weights[j] = from.weights[j] + (to.weights[j] - from.weights[j]) * t;
+                        }
+                    }
+                }
+                polygon_size = output_size;
+                current = 1 - current;
+            }
+            if (polygon_size < 3)
+            {
+                ++cull_stats.frustum;
+                return;
+            }
+
+            WindowVertex window_vertices[3 + clip_plane_count];
+            for (size_t i = 0; i < polygon_size; ++i)
+            {
+                if (!toWindow(polygons[current][i], window_vertices[i]))
+                {
+                    ++cull_stats.frustum;
+                    return;
+                }
+            }
+
+            // Winding of the whole polygon, positive for counter-clockwise in window coordinates
+            int64_t area = 0;
+            for (size_t i = 0; i < polygon_size; ++i)
+            {
+                const WindowVertex& from = window_vertices[i];
+                const WindowVertex& to = window_vertices[(i + 1) % polygon_size];
+                area += from.x * to.y - to.x * from.y;
+            }
+            if (area == 0)
+            {
+                ++cull_stats.zero_area;
+                return;
+            }
+            if ((cull_mode == CullMode::Clockwise && area < 0) || (cull_mode == CullMode::CounterClockwise && area > 0))
+            {
+                ++cull_stats.back_face;
+                return;
+            }
+
+            for (size_t i = 2; i < polygon_size; ++i)
+            {
+                setupTriangle(vertices, window_vertices[0], window_vertices[i - 1], window_vertices[i]);
+            }
+        }
+
+        // Coverage is first decided for aligned blocks of block_size x block_size pixels
+        static const int block_size = 8;
+
+        // Plane values are evaluated at the first pixel of the block row and stepped pixel by pixel from there,
+        // so all rasterization paths and render modes compute exactly the same value for a pixel.
+        // values receives the planes at (block_x, screen_y) stepped up to screen_x.
+        void evaluatePlanes(const Triangle& triangle, size_t plane_count, int block_x, int screen_x, int screen_y, float* values) const
+        {
+            const float x = sampleCoordinate(block_x);
+            const float y = sampleCoordinate(screen_y);
+            const InterpolationPlane* planes = getPlanes(triangle);
+            for (size_t i = 0; i < plane_count; ++i)
+            {
+                const InterpolationPlane& plane = planes[i];
+                float value = plane.evaluate(x, y);
+                for (int step_x = block_x; step_x < screen_x; ++step_x)
+                {
+                    value += plane.a;
+                }
+                values[i] = value;
+            }
+        }
+
+        // Sets vertex shader outputs / fragment shader inputs from the plane values of a pixel
+        static void setVaryings(WorkerContext& worker, const float* values)
+        {
+            unsigned char* context_data = reinterpret_cast<unsigned char*>(worker.context.get());
+            const float w = 1.0f / values[1];
+            for (size_t i = 0; i < worker.varying_offsets.size(); ++i)
+            {
+                *reinterpret_cast<float*>(context_data + worker.varying_offsets[i]) = values[2 + i] * w;
+            }
+        }
+
+        void writeFragColor(const ShaderContext& context, int screen_x, int screen_y)
+        {
+            rBuffer(screen_x, screen_y) = static_cast<unsigned char>(context.gl_FragColor.r * 255.0f);
+            gBuffer(screen_x, screen_y) = static_cast<unsigned char>(context.gl_FragColor.g * 255.0f);
+            bBuffer(screen_x, screen_y) = static_cast<unsigned char>(context.gl_FragColor.b * 255.0f);
+            aBuffer(screen_x, screen_y) = static_cast<unsigned char>(context.gl_FragColor.a * 255.0f);
+        }
+
+        // Runs the fragment shader with the plane values of the pixel and writes its color. Returns false if the shader
+        // sampled a texture: nothing is written, the worker shades by quads from then on and the pixel goes to shadeQuad().
+        bool shadeFragment(WorkerContext& worker, int screen_x, int screen_y, const float* values)
+        {
+            ShaderContext& context = *worker.context;
+            setVaryings(worker, values);
+            context.texture_calls = 0;
+            context.fragment_shader_main(); // Call fragment shader for the current pixel with interpolated attribute values
+            if (context.texture_calls)
+            {
+                worker.quad_textures = true;
+                return false;
+            }
+            writeFragColor(context, screen_x, screen_y);
+            return true;
+        }
+
+        // Shades the pixels of mask in the aligned 2x2 quad at (quad_x, quad_y), bit i for pixel (quad_x + i % 2, quad_y + i / 2),
+        // with one fragment shader run per pixel after the record runs of ShaderContext::texture2D. The planes of the
+        // triangle are evaluated as for the lanes of rasterizeBlockLanes. Returns the number of record runs.
+        size_t shadeQuad(WorkerContext& worker, const Triangle& triangle, int quad_x, int quad_y, unsigned mask)
+        {
+            ShaderContext& context = *worker.context;
+            float* values = worker.quad_values.data();
+            size_t record_runs = 0;
+            context.quad_mode = ShaderContext::QuadMode::Record;
+            for (int pixel = (mask & 1) ? 1 : 0; pixel < 3; ++pixel)
+            {
+                const int x = quad_x + pixel % 2;
+                const int y = quad_y + pixel / 2;
+                evaluatePlanes(triangle, worker.plane_count, x - x % block_size, x, y, values);
+                setVaryings(worker, values);
+                context.quad_pixel = pixel;
+                context.quad_coordinates[pixel].clear();
+                context.texture_calls = 0;
+                context.fragment_shader_main();
+                ++record_runs;
+            }
+            context.quad_mode = ShaderContext::QuadMode::Sample;
+            if (mask & 1)
+            {
+                context.quad_coordinates[0].clear();
+            }
+            for (int pixel = 0; pixel < 4; ++pixel)
+            {
+                if (mask & (1u << pixel))
+                {
+                    const int x = quad_x + pixel % 2;
+                    const int y = quad_y + pixel / 2;
+                    evaluatePlanes(triangle, worker.plane_count, x - x % block_size, x, y, values);
+                    setVaryings(worker, values);
+                    context.quad_pixel = pixel;
+                    context.texture_calls = 0;
+                    context.fragment_shader_main();
+                    writeFragColor(context, x, y);
+                }
+            }
+            context.quad_mode = ShaderContext::QuadMode::None;
+            return record_runs;
+        }
+
+        // Walks the pixels of [min_x, max_x] x [min_y, max_y] in memory order, edge functions and interpolation planes
+        // are stepped by a constant per pixel and evaluated once per row. Blocks known to be fully covered are walked
+        // without the coverage test. The rectangle must lie inside of one block. Returns true if any depth was written.
+        // Once the fragment shader samples textures, the pixels passing the depth test are shaded by quads after the walk.
+        template <bool test_coverage>
+        bool rasterizeBlockScalar(WorkerContext& worker, const Triangle& triangle, int min_x, int min_y, int max_x, int max_y)
+        {
+            float* values = worker.plane_values.data();
+            size_t tested = 0;
+            size_t passed = 0;
+            size_t record_runs = 0;
+            uint64_t quad_pixels = 0; // Bit (y - block_y) * block_size + x - block_x for the pixels left to shadeQuad()
+            const EdgeFunction& edge0 = triangle.edges[0];
+            const EdgeFunction& edge1 = triangle.edges[1];
+            const EdgeFunction& edge2 = triangle.edges[2];
+            const int64_t step_x0 = edge0.a * fixed_one;
+            const int64_t step_x1 = edge1.a * fixed_one;
+            const int64_t step_x2 = edge2.a * fixed_one;
+            const int64_t row_x = sampleToFixed(min_x);
+            const int block_x = min_x - min_x % block_size;
+            const int block_y = min_y - min_y % block_size;
+            const InterpolationPlane* planes = getPlanes(triangle);
+            const size_t plane_count = worker.plane_count;
+            for (int screen_y = min_y; screen_y <= max_y; ++screen_y)
+            {
+                const int64_t row_y = sampleToFixed(screen_y);
+                int64_t w0 = edge0.evaluate(row_x, row_y);
+                int64_t w1 = edge1.evaluate(row_x, row_y);
+                int64_t w2 = edge2.evaluate(row_x, row_y);
+                evaluatePlanes(triangle, plane_count, block_x, min_x, screen_y, values);
+                for (int screen_x = min_x; screen_x <= max_x; ++screen_x, w0 += step_x0, w1 += step_x1, w2 += step_x2)
+                {
+                    if (!test_coverage || (w0 | w1 | w2) >= 0)
+                    {
+                        ++tested;
+                        const uint32_t depth = toDepthValue(values[0]);
+                        if (depth < loadDepth(screen_x, screen_y))
+                        {
+                            storeDepth(screen_x, screen_y, depth);
+                            ++passed;
+                            bool shaded = false;
+                            if (!worker.quad_textures)
+                            {
+                                shaded = shadeFragment(worker, screen_x, screen_y, values);
+                                record_runs += shaded ? 0 : 1; // The first run sampling a texture is repeated by shadeQuad()
+                            }
+                            if (!shaded)
+                            {
+                                quad_pixels |= uint64_t(1) << ((screen_y - block_y) * block_size + screen_x - block_x);
+                            }
+                        }
+                    }
+                    for (size_t i = 0; i < plane_count; ++i)
+                    {
+                        values[i] += planes[i].a;
+                    }
+                }
+            }
+            for (int quad_y = 0; quad_y < block_size && quad_pixels; quad_y += 2)
+            {
+                for (int quad_x = 0; quad_x < block_size; quad_x += 2)
+                {
+                    const int shift = quad_y * block_size + quad_x;
+                    const unsigned mask = static_cast<unsigned>(((quad_pixels >> shift) & 3) | (((quad_pixels >> (shift + block_size)) & 3) << 2));
+                    if (mask)
+                    {
+                        record_runs += shadeQuad(worker, triangle, block_x + quad_x, block_y + quad_y, mask);
+                    }
+                }
+            }
+            worker.stats.pixels_tested += tested;
+            worker.stats.pixels_depth_passed += passed;
+            worker.stats.fragment_shader_invocations += passed;
+            worker.stats.quad_record_invocations += record_runs;
+            return passed != 0;
+        }
+
+        // Lanes of LaneShaderContext cover lane_block_width x lane_block_height pixels
+        static const int lane_block_width = BGFXShaderLanes::lane_width;
+        static const int lane_block_height = BGFXShaderLanes::lane_count / lane_block_width;
+
+        // Same as rasterizeBlockScalar, but shades lane_block_width x lane_block_height pixels per fragment shader call.
+        // Lanes outside of the triangle, of the rectangle or failing the depth test are computed but never written.
+        // Lane groups are aligned to the screen, so the pixel quads of the lanes (see texture2D) do not depend on the rectangle.
+        template <bool test_coverage>
+        bool rasterizeBlockLanes(WorkerContext& worker, const Triangle& triangle, int min_x, int min_y, int max_x, int max_y)
+        {
+            LaneShaderContext& context = *worker.lane_context;
+            size_t tested = 0;
+            size_t passed = 0;
+            const int block_x = min_x - min_x % block_size;
+            const InterpolationPlane* planes = getPlanes(triangle);
+            const size_t plane_count = worker.plane_count;
+            unsigned char* context_data = reinterpret_cast<unsigned char*>(&context);
+            // Plane values of all lanes, plane by plane
+            float lane_values[BGFXShaderLanes::lane_count];
+            float lane_w[BGFXShaderLanes::lane_count] = {}; // 1 / w of the lanes, set with the second plane
+            for (int group_y = min_y - min_y % lane_block_height; group_y <= max_y; group_y += lane_block_height)
+            {
+                for (int group_x = min_x - min_x % lane_block_width; group_x <= max_x; group_x += lane_block_width)
+                {
+                    unsigned active_lanes = 0;
+                    for (int lane = 0; lane < BGFXShaderLanes::lane_count; ++lane)
+                    {
+                        const int screen_x = group_x + lane % lane_block_width;
+                        const int screen_y = group_y + lane / lane_block_width;
+                        if (screen_x < min_x || screen_y < min_y || screen_x > max_x || screen_y > max_y)
+                        {
+                            continue;
+                        }
+                        if (test_coverage)
+                        {
+                            const int64_t x = sampleToFixed(screen_x);
+                            const int64_t y = sampleToFixed(screen_y);
+                            if ((triangle.edges[0].evaluate(x, y) | triangle.edges[1].evaluate(x, y) | triangle.edges[2].evaluate(x, y)) < 0)
+                            {
+                                continue;
+                            }
+                        }
+                        active_lanes |= 1u << lane;
+                    }
+                    if (!active_lanes)
+                    {
+                        continue;
+                    }
+
+                    // Walk the rows of the group exactly as rasterizeBlockScalar does, collecting the values of the lanes
+                    for (size_t i = 0; i < plane_count; ++i)
+                    {
+                        const InterpolationPlane& plane = planes[i];
+                        for (int row = 0; row < lane_block_height; ++row)
+                        {
+                            float value = plane.evaluate(sampleCoordinate(block_x), sampleCoordinate(group_y + row));
+                            for (int step_x = block_x; step_x < group_x + lane_block_width; ++step_x, value += plane.a)
+                            {
+                                if (step_x >= group_x)
+                                {
+                                    lane_values[row * lane_block_width + step_x - group_x] = value;
+                                }
+                            }
+                        }
+                        if (i == 0)
+                        {
+                            // Depth test
+                            for (int lane = 0; lane < BGFXShaderLanes::lane_count; ++lane)
+                            {
+                                if (active_lanes & (1u << lane))
+                                {
+                                    const int screen_x = group_x + lane % lane_block_width;
+                                    const int screen_y = group_y + lane / lane_block_width;
+                                    const uint32_t depth = toDepthValue(lane_values[lane]);
+                                    ++tested;
+                                    if (depth < loadDepth(screen_x, screen_y))
+                                    {
+                                        storeDepth(screen_x, screen_y, depth);
+                                        ++passed;
+                                    }
+                                    else
+                                    {
+                                        active_lanes &= ~(1u << lane);
+                                    }
+                                }
+                            }
+                            if (!active_lanes)
+                            {
+                                break;
+                            }
+                        }
+                        else if (i == 1)
+                        {
+                            for (int lane = 0; lane < BGFXShaderLanes::lane_count; ++lane)
+                            {
+                                lane_w[lane] = 1.0f / lane_values[lane];
+                            }
+                        }
+                        else
+                        {
+                            // Set vertex shader outputs / fragment shader inputs of all lanes
+                            for (int lane = 0; lane < BGFXShaderLanes::lane_count; ++lane)
+                            {
+                                lane_values[lane] *= lane_w[lane];
+                            }
+                            std::memcpy(context_data + worker.lane_varying_offsets[i - 2], lane_values, sizeof(lane_values));
+                        }
+                    }
+                    if (!active_lanes)
+                    {
+                        continue;
+                    }
+                    context.fragment_shader_main(); // Call fragment shader for all lanes at once
+
+                    for (int lane = 0; lane < BGFXShaderLanes::lane_count; ++lane)
+                    {
+                        if (active_lanes & (1u << lane))
+                        {
+                            const int screen_x = group_x + lane % lane_block_width;
+                            const int screen_y = group_y + lane / lane_block_width;
+                            rBuffer(screen_x, screen_y) = static_cast<unsigned char>(context.gl_FragColor.r[lane] * 255.0f);
+                            gBuffer(screen_x, screen_y) = static_cast<unsigned char>(context.gl_FragColor.g[lane] * 255.0f);
+                            bBuffer(screen_x, screen_y) = static_cast<unsigned char>(context.gl_FragColor.b[lane] * 255.0f);
+                            aBuffer(screen_x, screen_y) = static_cast<unsigned char>(context.gl_FragColor.a[lane] * 255.0f);
+                        }
+                    }
+                }
+            }
+            worker.stats.pixels_tested += tested;
+            worker.stats.pixels_depth_passed += passed;
+            worker.stats.fragment_shader_invocations += passed;
+            return passed != 0;
+        }
+
+        template <bool test_coverage>
+        bool rasterizeBlock(WorkerContext& worker, const Triangle& triangle, int min_x, int min_y, int max_x, int max_y)
+        {
+            if (shading_mode == ShadingMode::VisibilityBuffer)
+            {
+                return rasterizeBlockVisibility<test_coverage>(worker.stats, triangle, min_x, min_y, max_x, max_y);
+            }
+            if (worker.lane_context)
+            {
+                return rasterizeBlockLanes<test_coverage>(worker, triangle, min_x, min_y, max_x, max_y);
+            }
+            return rasterizeBlockScalar<test_coverage>(worker, triangle, min_x, min_y, max_x, max_y);
+        }
+
+        // Depth only variant of rasterizeBlockScalar for ShadingMode::VisibilityBuffer, stores the triangle of the pixels
+        // passing the depth test instead of shading them. Depth is stepped exactly as in the shading paths.
+        template <bool test_coverage>
+        bool rasterizeBlockVisibility(Stats& worker_stats, const Triangle& triangle, int min_x, int min_y, int max_x, int max_y)
+        {
+            size_t tested = 0;
+            size_t passed = 0;
+            const EdgeFunction& edge0 = triangle.edges[0];
+            const EdgeFunction& edge1 = triangle.edges[1];
+            const EdgeFunction& edge2 = triangle.edges[2];
+            const int64_t step_x0 = edge0.a * fixed_one;
+            const int64_t step_x1 = edge1.a * fixed_one;
+            const int64_t step_x2 = edge2.a * fixed_one;
+            const int64_t row_x = sampleToFixed(min_x);
+            const int block_x = min_x - min_x % block_size;
+            const InterpolationPlane& depth_plane = getPlanes(triangle)[0];
+            const uint32_t triangle_id = static_cast<uint32_t>(&triangle - triangles.data());
+            for (int screen_y = min_y; screen_y <= max_y; ++screen_y)
+            {
+                const int64_t row_y = sampleToFixed(screen_y);
+                int64_t w0 = edge0.evaluate(row_x, row_y);
+                int64_t w1 = edge1.evaluate(row_x, row_y);
+                int64_t w2 = edge2.evaluate(row_x, row_y);
+                float depth = depth_plane.evaluate(sampleCoordinate(block_x), sampleCoordinate(screen_y));
+                for (int step_x = block_x; step_x < min_x; ++step_x)
+                {
+                    depth += depth_plane.a;
+                }
+                for (int screen_x = min_x; screen_x <= max_x; ++screen_x, w0 += step_x0, w1 += step_x1, w2 += step_x2, depth += depth_plane.a)
+                {
+                    if (test_coverage && (w0 | w1 | w2) < 0)
+                    {
+                        continue;
+                    }
+                    const uint32_t depth_value = toDepthValue(depth);
+                    ++tested;
+                    if (depth_value < loadDepth(screen_x, screen_y))
+                    {
+                        storeDepth(screen_x, screen_y, depth_value);
+                        visibilityBuffer(screen_x, screen_y) = triangle_id;
+                        ++passed;
+                    }
+                }
+            }
+            worker_stats.pixels_tested += tested;
+            worker_stats.pixels_depth_passed += passed;
+            return passed != 0;
+        }
+
+        // Second pass of ShadingMode::VisibilityBuffer: every pixel of the rectangle covered by a triangle is shaded once,
+        // with the contexts worker_index of the triangle's draw and plane values evaluated as the forward paths do,
+        // so both shading modes produce the same image.
+        // Neighbouring pixels may belong to different triangles. Lane groups are shaded once per triangle, with all lanes
+        // evaluating the planes of that triangle as rasterizeBlockLanes does, and only the lanes of the triangle written.
+        void shadeVisiblePixels(size_t worker_index, Stats& worker_stats, int min_x, int min_y, int max_x, int max_y)
+        {
+            uint32_t lane_triangles[BGFXShaderLanes::lane_count];
+            for (int group_y = min_y - min_y % lane_block_height; group_y <= max_y; group_y += lane_block_height)
+            {
+                for (int group_x = min_x - min_x % lane_block_width; group_x <= max_x; group_x += lane_block_width)
+                {
+                    unsigned remaining_lanes = 0;
+                    for (int lane = 0; lane < BGFXShaderLanes::lane_count; ++lane)
+                    {
+                        const int screen_x = group_x + lane % lane_block_width;
+                        const int screen_y = group_y + lane / lane_block_width;
+                        if (screen_x < min_x || screen_y < min_y || screen_x > max_x || screen_y > max_y)
+                        {
+                            continue;
+                        }
+                        lane_triangles[lane] = visibilityBuffer(screen_x, screen_y);
+                        if (lane_triangles[lane] != no_triangle)
+                        {
+                            remaining_lanes |= 1u << lane;
+                        }
+                    }
+                    while (remaining_lanes)
+                    {
+                        int first_lane = 0;
+                        while (!(remaining_lanes & (1u << first_lane)))
+                        {
+                            ++first_lane;
+                        }
+                        const Triangle& triangle = triangles[lane_triangles[first_lane]];
+                        unsigned active_lanes = 0;
+                        for (int lane = first_lane; lane < BGFXShaderLanes::lane_count; ++lane)
+                        {
+                            if ((remaining_lanes & (1u << lane)) && lane_triangles[lane] == lane_triangles[first_lane])
+                            {
+                                active_lanes |= 1u << lane;
+                            }
+                        }
+                        remaining_lanes &= ~active_lanes;
+
+                        WorkerContext& worker = visibility_draws[triangle.draw][worker_index];
+                        float* values = worker.plane_values.data();
+                        if (!worker.lane_context)
+                        {
+                            unsigned quad_lanes = 0; // Lanes left to shadeQuad()
+                            for (int lane = 0; lane < BGFXShaderLanes::lane_count; ++lane)
+                            {
+                                if (active_lanes & (1u << lane))
+                                {
+                                    const int screen_x = group_x + lane % lane_block_width;
+                                    const int screen_y = group_y + lane / lane_block_width;
+                                    ++worker_stats.fragment_shader_invocations;
+                                    if (worker.quad_textures)
+                                    {
+                                        quad_lanes |= 1u << lane;
+                                        continue;
+                                    }
+                                    evaluatePlanes(triangle, worker.plane_count, screen_x - screen_x % block_size, screen_x, screen_y, values);
+                                    if (!shadeFragment(worker, screen_x, screen_y, values))
+                                    {
+                                        ++worker_stats.quad_record_invocations; // Repeated by shadeQuad()
+                                        quad_lanes |= 1u << lane;
+                                    }
+                                }
+                            }
+                            // Lanes (quad, quad + 1, quad + lane_block_width, quad + lane_block_width + 1) form a quad
+                            for (int quad = 0; quad < lane_block_width; quad += 2)
+                            {
+                                const unsigned mask = ((quad_lanes >> quad) & 3) | (((quad_lanes >> (quad + lane_block_width)) & 3) << 2);
+                                if (mask)
+                                {
+                                    worker_stats.quad_record_invocations += shadeQuad(worker, triangle, group_x + quad, group_y, mask);
+                                }
+                            }
+                            continue;
+                        }
+
+                        LaneShaderContext& context = *worker.lane_context;
+                        unsigned char* context_data = reinterpret_cast<unsigned char*>(&context);
+                        for (int lane = 0; lane < BGFXShaderLanes::lane_count; ++lane)
+                        {
+                            const int screen_x = group_x + lane % lane_block_width;
+                            const int screen_y = group_y + lane / lane_block_width;
+                            evaluatePlanes(triangle, worker.plane_count, screen_x - screen_x % block_size, screen_x, screen_y, values);
+                            const float w = 1.0f / values[1];
+                            for (size_t i = 0; i < worker.lane_varying_offsets.size(); ++i)
+                            {
+                                reinterpret_cast<float*>(context_data + worker.lane_varying_offsets[i])[lane] = values[2 + i] * w;
+                            }
+                        }
+                        context.fragment_shader_main(); // Call fragment shader for all lanes at once
+
+                        for (int lane = 0; lane < BGFXShaderLanes::lane_count; ++lane)
+                        {
+                            if (active_lanes & (1u << lane))
+                            {
+                                const int screen_x = group_x + lane % lane_block_width;
+                                const int screen_y = group_y + lane / lane_block_width;
+                                ++worker_stats.fragment_shader_invocations;
+                                rBuffer(screen_x, screen_y) = static_cast<unsigned char>(context.gl_FragColor.r[lane] * 255.0f);
+                                gBuffer(screen_x, screen_y) = static_cast<unsigned char>(context.gl_FragColor.g[lane] * 255.0f);
+                                bBuffer(screen_x, screen_y) = static_cast<unsigned char>(context.gl_FragColor.b[lane] * 255.0f);
+                                aBuffer(screen_x, screen_y) = static_cast<unsigned char>(context.gl_FragColor.a[lane] * 255.0f);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        // Smallest depth of the triangle over the pixels of [min_x, max_x] x [min_y, max_y], lowered by the rounding error
+        // of the per pixel plane stepping, so no pixel of the triangle is nearer than the returned value
+        float getMinDepth(const Triangle& triangle, int min_x, int min_y, int max_x, int max_y) const
+        {
+            const InterpolationPlane& plane = getPlanes(triangle)[0];
+            const float x = sampleCoordinate(plane.a > 0.0f ? min_x : max_x);
+            const float y = sampleCoordinate(plane.b > 0.0f ? min_y : max_y);
+            const float error = (std::abs(plane.a) * (std::abs(x) + block_size) + std::abs(plane.b * y) + std::abs(plane.c)) *
+                (4 * block_size * std::numeric_limits<float>::epsilon());
+            return plane.evaluate(x, y) - error;
+        }
+
+        // Recomputes the farthest depth of the block containing the pixel
+        void updateHiZ(int block_x, int block_y)
+        {
+            block_x -= block_x % block_size;
+            block_y -= block_y % block_size;
+            const int max_x = std::min(block_x + block_size, static_cast<int>(width));
+            const int max_y = std::min(block_y + block_size, static_cast<int>(height));
+            uint32_t max_depth = loadDepth(block_x, block_y);
+            for (int y = block_y; y < max_y; ++y)
+            {
+                for (int x = block_x; x < max_x; ++x)
+                {
+                    max_depth = std::max(max_depth, loadDepth(x, y));
+                }
+            }
+            hiZBuffer(block_x, block_y) = max_depth;
+        }
+
+        // Rasterizes the part of the triangle inside of [clip_min_x, clip_max_x] x [clip_min_y, clip_max_y] screen rectangle.
+        // Edge functions are evaluated at the corners of every block first: blocks outside of any edge are skipped,
+        // blocks inside of all edges are filled without per pixel tests, only the rest is tested per pixel.
+        // Blocks where the triangle is behind the farthest stored depth are skipped before any pixel is visited.
+        void rasterizeTriangle(WorkerContext& worker, const Triangle& triangle, int clip_min_x, int clip_min_y, int clip_max_x, int clip_max_y)
+        {
+            const int min_x = std::max(triangle.min_x, clip_min_x);
+            const int min_y = std::max(triangle.min_y, clip_min_y);
+            const int max_x = std::min(triangle.max_x, clip_max_x);
+            const int max_y = std::min(triangle.max_y, clip_max_y);
+            if (min_x > max_x || min_y > max_y)
+            {
+                return;
+            }
+
+            for (int block_y = min_y - min_y % block_size; block_y <= max_y; block_y += block_size)
+            {
+                const int block_min_y = std::max(block_y, min_y);
+                const int block_max_y = std::min(block_y + block_size - 1, max_y);
+                const int64_t corner_y0 = sampleToFixed(block_min_y);
+                const int64_t corner_y1 = sampleToFixed(block_max_y);
+                for (int block_x = min_x - min_x % block_size; block_x <= max_x; block_x += block_size)
+                {
+                    const int block_min_x = std::max(block_x, min_x);
+                    const int block_max_x = std::min(block_x + block_size - 1, max_x);
+                    const int64_t corner_x0 = sampleToFixed(block_min_x);
+                    const int64_t corner_x1 = sampleToFixed(block_max_x);
+
+                    bool outside = false;
+                    bool inside = true;
+                    for (int i = 0; i < 3 && !outside; ++i)
+                    {
+                        // Edge functions are linear, so their extremes over the block are at the corners
+                        const EdgeFunction& edge = triangle.edges[i];
+                        const int64_t max_value = edge.evaluate(edge.a > 0 ? corner_x1 : corner_x0, edge.b > 0 ? corner_y1 : corner_y0);
+                        const int64_t min_value = edge.evaluate(edge.a > 0 ? corner_x0 : corner_x1, edge.b > 0 ? corner_y0 : corner_y1);
+                        outside = max_value < 0;
+                        inside = inside && min_value >= 0;
+                    }
+                    if (outside)
+                    {
+                        continue;
+                    }
+                    if (use_hi_z && toDepthValue(getMinDepth(triangle, block_min_x, block_min_y, block_max_x, block_max_y)) >= hiZBuffer(block_x, block_y))
+                    {
+                        continue; // Occluded by the depth already stored in the block
+                    }
+                    const bool depth_written = inside ?
+                        rasterizeBlock<false>(worker, triangle, block_min_x, block_min_y, block_max_x, block_max_y) :
+                        rasterizeBlock<true>(worker, triangle, block_min_x, block_min_y, block_max_x, block_max_y);
+                    if (use_hi_z && depth_written)
+                    {
+                        updateHiZ(block_x, block_y);
+                    }
+                }
+            }
+        }
+
+        // Sort-middle rendering: all triangles are set up first and binned into screen tiles,
+        // then tiles are rasterized in parallel. Every tile keeps the submission order of its triangles,
+        // and no pixel belongs to two tiles, so the result is the same as in RenderMode::Immediate.
+        void renderTiled(std::vector<WorkerContext>& workers)
+        {
+            const uint64_t setup_start_time = getTime();
+            const size_t first_new_triangle = shading_mode == ShadingMode::VisibilityBuffer ? triangles.size() : 0;
+            {
+                BGFX_SHADER_TRACE_SCOPE(getTraceBuffer(0), "setup", -1);
+                const size_t draw_triangle_count = triangle_count * getDrawInstanceCount();
+                if (shading_mode != ShadingMode::VisibilityBuffer)
+                {
+                    triangles.clear();
+                    triangles.reserve(draw_triangle_count);
+                    triangle_planes.clear();
+                    triangle_planes.reserve(draw_triangle_count * getPlaneCount());
+                }
+                for (size_t triangle_index = 0; triangle_index < draw_triangle_count; ++triangle_index)
+                {
+                    setupTriangles(triangle_index);
+                }
+            }
+
+            BGFX_SHADER_TRACE_SCOPE(getTraceBuffer(0), "tiles", -1);
+            const int tile_count_x = static_cast<int>((width + tile_size - 1) / tile_size);
+            const int tile_count_y = static_cast<int>((height + tile_size - 1) / tile_size);
+            const int tile_size_int = static_cast<int>(tile_size);
+            std::vector<std::vector<uint32_t>> tiles(static_cast<size_t>(tile_count_x) * tile_count_y);
+            for (size_t triangle_index = first_new_triangle; triangle_index < triangles.size(); ++triangle_index)
+            {
+                const Triangle& triangle = triangles[triangle_index];
+                const int min_x = std::max(triangle.min_x, clip_min_x);
+                const int min_y = std::max(triangle.min_y, clip_min_y);
+                const int max_x = std::min(triangle.max_x, clip_max_x);
+                const int max_y = std::min(triangle.max_y, clip_max_y);
+                if (min_x > max_x || min_y > max_y)
+                {
+                    continue;
+                }
+                for (int tile_y = min_y / tile_size_int; tile_y <= max_y / tile_size_int; ++tile_y)
+                {
+                    for (int tile_x = min_x / tile_size_int; tile_x <= max_x / tile_size_int; ++tile_x)
+                    {
+                        tiles[static_cast<size_t>(tile_y) * tile_count_x + tile_x].push_back(static_cast<uint32_t>(triangle_index));
+                    }
+                }
+            }
+            stats.triangles_rasterized += triangles.size() - first_new_triangle;
+            stats.setup_ns += getTime() - setup_start_time;
+
+            thread_pool->run(tiles.size(), [&](size_t tile_index, size_t worker_index)
+            {
+                BGFX_SHADER_TRACE_SCOPE(getTraceBuffer(1 + worker_index), "tile", static_cast<int64_t>(tile_index));
+                const uint64_t raster_start_time = getTime();
+                WorkerContext& worker = workers[worker_index];
+                const std::vector<uint32_t>& tile = tiles[tile_index];
+                const int tile_min_x = std::max(static_cast<int>(tile_index % tile_count_x) * tile_size_int, clip_min_x);
+                const int tile_min_y = std::max(static_cast<int>(tile_index / tile_count_x) * tile_size_int, clip_min_y);
+                const int tile_max_x = std::min(static_cast<int>(tile_index % tile_count_x) * tile_size_int + tile_size_int - 1, clip_max_x);
+                const int tile_max_y = std::min(static_cast<int>(tile_index / tile_count_x) * tile_size_int + tile_size_int - 1, clip_max_y);
+                for (size_t i = 0; i < tile.size(); ++i)
+                {
+                    rasterizeTriangle(worker, triangles[tile[i]], tile_min_x, tile_min_y, tile_max_x, tile_max_y);
+                }
+                worker.stats.raster_ns += getTime() - raster_start_time;
+            });
+        }
+
+        // State of a draw queued by submit()
+        struct Draw
+        {
+            uint32_t depth;
+            VertexStream vertex_streams[max_vertex_streams];
+            const void* index_buffer;
+            bool index_buffer32;
+            size_t first_index;
+            size_t triangle_count;
+            int base_vertex;
+            const unsigned char* instance_data;
+            size_t instance_count;
+            VertexLayout instance_layout;
+            const ShaderContext* submitted_program; // The application's program, identifies the program of the draw
+            const ShaderContext* program;
+            const LaneShaderContext* lane_program;
+            std::unique_ptr<ShaderContext> program_copy; // Uniforms as they were at submit()
+            std::unique_ptr<LaneShaderContext> lane_program_copy;
+            Attributes input_attributes;
+            Attributes output_attributes;
+            Attributes lane_input_attributes;
+            CullMode cull_mode;
+            int view_x, view_y;
+            unsigned view_width, view_height;
+            int scissor_x, scissor_y;
+            unsigned scissor_width, scissor_height;
+        };
+
+        std::vector<Draw> draws;
+
+        void saveDrawState(Draw& draw) const
+        {
+            std::copy(vertex_streams, vertex_streams + max_vertex_streams, draw.vertex_streams);
+            draw.index_buffer = index_buffer;
+            draw.index_buffer32 = index_buffer32;
+            draw.first_index = first_index;
+            draw.triangle_count = triangle_count;
+            draw.base_vertex = base_vertex;
+            draw.instance_data = instance_data;
+            draw.instance_count = instance_count;
+            draw.instance_layout = instance_layout;
+            draw.submitted_program = program;
+            draw.program = program;
+            draw.lane_program = lane_program;
+            draw.input_attributes = input_attributes;
+            draw.output_attributes = output_attributes;
+            draw.lane_input_attributes = lane_input_attributes;
+            draw.cull_mode = cull_mode;
+            draw.view_x = view_x;
+            draw.view_y = view_y;
+            draw.view_width = view_width;
+            draw.view_height = view_height;
+            draw.scissor_x = scissor_x;
+            draw.scissor_y = scissor_y;
+            draw.scissor_width = scissor_width;
+            draw.scissor_height = scissor_height;
+        }
+
+        void restoreDrawState(const Draw& draw)
+        {
+            std::copy(draw.vertex_streams, draw.vertex_streams + max_vertex_streams, vertex_streams);
+            index_buffer = draw.index_buffer;
+            index_buffer32 = draw.index_buffer32;
+            first_index = draw.first_index;
+            triangle_count = draw.triangle_count;
+            base_vertex = draw.base_vertex;
+            instance_data = draw.instance_data;
+            instance_count = draw.instance_count;
+            instance_layout = draw.instance_layout;
+            program = draw.program;
+            lane_program = draw.lane_program;
+            input_attributes = draw.input_attributes;
+            output_attributes = draw.output_attributes;
+            lane_input_attributes = draw.lane_input_attributes;
+            cull_mode = draw.cull_mode;
+            view_x = draw.view_x;
+            view_y = draw.view_y;
+            view_width = draw.view_width;
+            view_height = draw.view_height;
+            scissor_x = draw.scissor_x;
+            scissor_y = draw.scissor_y;
+            scissor_width = draw.scissor_width;
+            scissor_height = draw.scissor_height;
+        }
+
+        void resetStats()
+        {
+            cull_stats = CullStats();
+            stats = Stats();
+            output_ns = 0;
+        }
+
+        // Draws with the current state, adds to cull_stats and stats
+        void executeDraw()
+        {
+            BGFX_SHADER_TRACE_SCOPE(getTraceBuffer(0), "draw", static_cast<int64_t>(stats.draw_count));
+            if (!index_buffer || !triangle_count)
+            {
+                std::cerr << "Index buffer is not specified or triangle count is zero" << std::endl;
+                assert(false);
+                return;
+            }
+            if (instance_data && !instance_count)
+            {
+                return; // Nothing to draw, like bgfx
+            }
+
+            bool has_vertex_stream = false;
+            vertex_count = 0;
+            for (size_t stream = 0; stream < max_vertex_streams; ++stream)
+            {
+                const VertexStream& vertex_stream = vertex_streams[stream];
+                if (!vertex_stream.data)
+                {
+                    continue;
+                }
+                vertex_count = has_vertex_stream ? std::min(vertex_count, vertex_stream.vertex_count) : vertex_stream.vertex_count;
+                has_vertex_stream = true;
+            }
+            if (!vertex_count)
+            {
+                std::cerr << "Vertex buffer is not specified or vertex count is zero" << std::endl;
+                assert(false);
+                return;
+            }
+
+            if (!program)
+            {
+                std::cerr << "Shader program is not specified" << std::endl;
+                assert(false);
+                return;
+            }
+
+            input_attributes_layout = VertexLayout::fromAttributes(input_attributes);
+            for (size_t stream = 0; stream < max_vertex_streams; ++stream)
+            {
+                if (vertex_streams[stream].data && vertex_streams[stream].layout.empty() && input_attributes_layout.empty())
+                {
+                    std::cerr << "Input Vertex buffer attributes are empty!" << std::endl;
+                    assert(false);
+                    return;
+                }
+            }
+
+            // Shade with private copies of the program, one per thread, so the application's program is never written to
+            ThreadPool* pool = 0;
+            if (render_mode == RenderMode::Tiled)
+            {
+                pool = &getThreadPool();
+#if defined(BGFX_SHADER_TRACE)
+                if (tracing)
+                {
+                    trace->addThreads(1 + pool->getThreadCount());
+                }
+#endif
+            }
+            std::vector<WorkerContext> workers(pool ? pool->getThreadCount() : 1);
+            for (size_t i = 0; i < workers.size(); ++i)
+            {
+                workers[i].stats = Stats();
+                workers[i].quad_textures = false;
+                workers[i].context = program->clone();
+                if (lane_program)
+                {
+                    workers[i].lane_context = lane_program->clone();
+                    static_cast<ShaderUniforms&>(*workers[i].lane_context) = *program;
+                }
+            }
+
+            ++stats.draw_count;
+            stats.triangles_submitted += triangle_count * getDrawInstanceCount();
+            processVertices(workers, pool);
+            drawTriangles(workers);
+
+            for (size_t i = 0; i < workers.size(); ++i)
+            {
+                const Stats& worker_stats = workers[i].stats;
+                stats.pixels_tested += worker_stats.pixels_tested;
+                stats.pixels_depth_passed += worker_stats.pixels_depth_passed;
+                stats.fragment_shader_invocations += worker_stats.fragment_shader_invocations;
+                stats.quad_record_invocations += worker_stats.quad_record_invocations;
+                stats.vertex_ns += worker_stats.vertex_ns;
+                stats.raster_ns += worker_stats.raster_ns;
+            }
+            if (shading_mode == ShadingMode::VisibilityBuffer)
+            {
+                visibility_draws.push_back(std::move(workers));
+            }
+        }
+
+        static const size_t triangle_batch_size = 256;
+
+        // Primitive processing of executeDraw(), after the vertex stage
+        void drawTriangles(std::vector<WorkerContext>& workers)
+        {
+            std::vector<size_t> lane_varying_offsets; // Offsets inside of LaneShaderContext of the varying streams
+            if (lane_program)
+            {
+                for (size_t i = 0; i < lane_input_attributes.size(); ++i)
+                {
+                    for (size_t component = 0; component < lane_input_attributes[i].getComponentCount(); ++component)
+                    {
+                        lane_varying_offsets.push_back(lane_input_attributes[i].getOffset() + component * sizeof(BGFXShaderLanes::vfloat));
+                    }
+                }
+                if (lane_varying_offsets.size() != post_transform_buffer.getVaryingStreamCount())
+                {
+                    std::cerr << "Lane program inputs do not match vertex shader outputs" << std::endl;
+                    assert(false);
+                    return;
+                }
+            }
+
+            for (size_t i = 0; i < workers.size(); ++i)
+            {
+                workers[i].plane_count = getPlaneCount();
+                workers[i].plane_values.resize(getPlaneCount());
+                workers[i].quad_values.resize(getPlaneCount());
+                workers[i].varying_offsets.clear();
+                for (size_t stream = 0; stream < post_transform_buffer.getVaryingStreamCount(); ++stream)
+                {
+                    workers[i].varying_offsets.push_back(post_transform_buffer.getVaryingOffset(stream));
+                }
+                workers[i].lane_varying_offsets = lane_varying_offsets;
+            }
+
+            clip_min_x = std::max(view_x, 0);
+            clip_min_y = std::max(view_y, 0);
+            clip_max_x = std::min(view_x + static_cast<int>(view_width), static_cast<int>(width)) - 1;
+            clip_max_y = std::min(view_y + static_cast<int>(view_height), static_cast<int>(height)) - 1;
+            if (scissor_width && scissor_height)
+            {
+                clip_min_x = std::max(clip_min_x, scissor_x);
+                clip_min_y = std::max(clip_min_y, scissor_y);
+                clip_max_x = std::min(clip_max_x, scissor_x + static_cast<int>(scissor_width) - 1);
+                clip_max_y = std::min(clip_max_y, scissor_y + static_cast<int>(scissor_height) - 1);
+            }
+            if (clip_min_x > clip_max_x || clip_min_y > clip_max_y)
+            {
+                return;
+            }
+
+            guard_band_min_x = (static_cast<float>(-guard_band - view_x) / static_cast<float>(view_width)) * 2.0f - 1.0f;
+            guard_band_max_x = (static_cast<float>(guard_band - view_x) / static_cast<float>(view_width)) * 2.0f - 1.0f;
+            guard_band_min_y = (static_cast<float>(-guard_band - view_y) / static_cast<float>(view_height)) * 2.0f - 1.0f;
+            guard_band_max_y = (static_cast<float>(guard_band - view_y) / static_cast<float>(view_height)) * 2.0f - 1.0f;
+
+            if (shading_mode == ShadingMode::VisibilityBuffer)
+            {
+                visible_min_x = std::min(visible_min_x, clip_min_x);
+                visible_min_y = std::min(visible_min_y, clip_min_y);
+                visible_max_x = std::max(visible_max_x, clip_max_x);
+                visible_max_y = std::max(visible_max_y, clip_max_y);
+            }
+
+            // Tiles made of whole blocks keep every Hi-Z block on one thread
+            use_hi_z = render_mode == RenderMode::Immediate || tile_size % block_size == 0;
+
+            if (render_mode == RenderMode::Tiled)
+            {
+                renderTiled(workers);
+                return;
+            }
+
+            // Triangles are set up and rasterized batch by batch. Triangle IDs index triangles, so in
+            // ShadingMode::VisibilityBuffer the batches are appended and kept until the visible pixels are shaded.
+            const size_t draw_triangle_count = triangle_count * getDrawInstanceCount();
+            WorkerContext& worker = workers[0];
+            for (size_t first_triangle = 0; first_triangle < draw_triangle_count; first_triangle += triangle_batch_size)
+            {
+                const uint64_t setup_start_time = getTime();
+                const size_t first_new_triangle = shading_mode == ShadingMode::VisibilityBuffer ? triangles.size() : 0;
+                {
+                    BGFX_SHADER_TRACE_SCOPE(getTraceBuffer(0), "setup", static_cast<int64_t>(first_triangle));
+                    if (shading_mode != ShadingMode::VisibilityBuffer)
+                    {
+                        triangles.clear();
+                        triangle_planes.clear();
+                    }
+                    const size_t last_triangle = std::min(first_triangle + size_t(triangle_batch_size), draw_triangle_count);
+                    for (size_t triangle_index = first_triangle; triangle_index < last_triangle; ++triangle_index)
+                    {
+                        setupTriangles(triangle_index);
+                    }
+                }
+                stats.triangles_rasterized += triangles.size() - first_new_triangle;
+                const uint64_t raster_start_time = getTime();
+                stats.setup_ns += raster_start_time - setup_start_time;
+                {
+                    BGFX_SHADER_TRACE_SCOPE(getTraceBuffer(0), "raster", static_cast<int64_t>(first_triangle));
+                    for (size_t i = first_new_triangle; i < triangles.size(); ++i)
+                    {
+                        rasterizeTriangle(worker, triangles[i], clip_min_x, clip_min_y, clip_max_x, clip_max_y);
+                    }
+                }
+                worker.stats.raster_ns += getTime() - raster_start_time;
+            }
+        }
+
+        // Starts the draws of render() or frame(): in ShadingMode::VisibilityBuffer the visibility buffer is cleared once,
+        // the triangles of all draws are kept and shaded by resolveVisibility() after the last draw
+        void beginDraws()
+        {
+            if (shading_mode != ShadingMode::VisibilityBuffer)
+            {
+                return;
+            }
+            visibility_buffer.assign(size, uint32_t(no_triangle));
+            triangles.clear();
+            triangle_planes.clear();
+            visibility_draws.clear();
+            visible_min_x = std::numeric_limits<int>::max();
+            visible_min_y = std::numeric_limits<int>::max();
+            visible_max_x = std::numeric_limits<int>::min();
+            visible_max_y = std::numeric_limits<int>::min();
+        }
+
+        // Shades every visible pixel of the draws since beginDraws() once, with the contexts of the draw of its triangle
+        void resolveVisibility()
+        {
+            if (shading_mode != ShadingMode::VisibilityBuffer || visibility_draws.empty())
+            {
+                return;
+            }
+            if (visible_min_x <= visible_max_x && visible_min_y <= visible_max_y)
+            {
+                std::vector<Stats> worker_stats(visibility_draws[0].size());
+                if (render_mode == RenderMode::Tiled)
+                {
+                    const int tile_count_x = static_cast<int>((width + tile_size - 1) / tile_size);
+                    const int tile_count_y = static_cast<int>((height + tile_size - 1) / tile_size);
+                    const int tile_size_int = static_cast<int>(tile_size);
+                    thread_pool->run(static_cast<size_t>(tile_count_x) * tile_count_y, [&](size_t tile_index, size_t worker_index)
+                    {
+                        const int tile_min_x = std::max(static_cast<int>(tile_index % tile_count_x) * tile_size_int, visible_min_x);
+                        const int tile_min_y = std::max(static_cast<int>(tile_index / tile_count_x) * tile_size_int, visible_min_y);
+                        const int tile_max_x = std::min(static_cast<int>(tile_index % tile_count_x) * tile_size_int + tile_size_int - 1, visible_max_x);
+                        const int tile_max_y = std::min(static_cast<int>(tile_index / tile_count_x) * tile_size_int + tile_size_int - 1, visible_max_y);
+                        if (tile_min_x > tile_max_x || tile_min_y > tile_max_y)
+                        {
+                            return;
+                        }
+                        BGFX_SHADER_TRACE_SCOPE(getTraceBuffer(1 + worker_index), "shade", static_cast<int64_t>(tile_index));
+                        const uint64_t shade_start_time = getTime();
+                        shadeVisiblePixels(worker_index, worker_stats[worker_index], tile_min_x, tile_min_y, tile_max_x, tile_max_y);
+                        worker_stats[worker_index].shade_ns += getTime() - shade_start_time;
+                    });
+                }
+                else
+                {
+                    BGFX_SHADER_TRACE_SCOPE(getTraceBuffer(0), "shade", -1);
+                    const uint64_t shade_start_time = getTime();
+                    shadeVisiblePixels(0, worker_stats[0], visible_min_x, visible_min_y, visible_max_x, visible_max_y);
+                    worker_stats[0].shade_ns += getTime() - shade_start_time;
+                }
+                for (size_t i = 0; i < worker_stats.size(); ++i)
+                {
+                    stats.fragment_shader_invocations += worker_stats[i].fragment_shader_invocations;
+                    stats.quad_record_invocations += worker_stats[i].quad_record_invocations;
+                    stats.shade_ns += worker_stats[i].shade_ns;
+                }
+            }
+            visibility_draws.clear();
         }
 
     public:
         Attributes input_attributes;
         Attributes output_attributes;
+        Attributes lane_input_attributes; // Varyings of the lane program, in the order of output_attributes
 
-        CPURendering(unsigned width_, unsigned height_) : width(width_), height(height_), size(width * height)
+        CPURendering(unsigned width_, unsigned height_, DepthFormat depth_format_ = DepthFormat::D32F)
+            : width(width_), height(height_), blocks_x((width + block_size - 1) / block_size),
+            size(blocks_x * block_size * ((height + block_size - 1) / block_size) * block_size), depth_format(depth_format_)
         {
-            rgba_buffer.resize(size * 4, 0);
-            z_buffer.resize(size, 4194304.0f);
+            rgba_buffer.resize(size * 4);
+            if (depth_format == DepthFormat::D16)
+            {
+                depth_buffer16.resize(size);
+            }
+            else
+            {
+                depth_buffer32.resize(size);
+            }
+            hi_z_buffer.resize(size / (block_size * block_size));
+            clear();
 
-            vertex_buffer = 0;
+            for (size_t stream = 0; stream < max_vertex_streams; ++stream)
+            {
+                vertex_streams[stream].data = 0;
+                vertex_streams[stream].vertex_count = 0;
+            }
             vertex_count = 0;
             index_buffer = 0;
+            index_buffer32 = false;
+            first_index = 0;
             triangle_count = 0;
-            vertex_size = 0;
+            base_vertex = 0;
+            instance_data = 0;
+            instance_count = 0;
+            program = 0;
+            lane_program = 0;
+
+            render_mode = RenderMode::Immediate;
+            tile_size = 64;
+            thread_count = 0;
+
+            setViewRect(0, 0, width, height);
+            setScissor(0, 0, 0, 0);
+
+            cull_mode = CullMode::None;
+            resetStats();
+
+#if defined(BGFX_SHADER_TRACE)
+            tracing = false;
+#endif
+
+            shading_mode = ShadingMode::Forward;
+
+            framebuffer_count = 2;
+            async_frame_count = 0;
+            render_stopping = false;
+        }
+
+        ~CPURendering()
+        {
+            finishAsyncFrames();
+        }
+
+        // Clears color to 0 and depth to the far plane
+        void clear()
+        {
+            std::fill(rgba_buffer.begin(), rgba_buffer.end(), static_cast<unsigned char>(0));
+            const uint32_t far_depth = toDepthValue(1.0f);
+            std::fill(depth_buffer16.begin(), depth_buffer16.end(), static_cast<uint16_t>(far_depth));
+            std::fill(depth_buffer32.begin(), depth_buffer32.end(), far_depth);
+            std::fill(hi_z_buffer.begin(), hi_z_buffer.end(), far_depth);
         }
 
+        // Tightly packed float attributes described by input_attributes, replaces all vertex streams
         void setVertexBuffer(void* vertex_buffer_, size_t vertex_count_)
         {
-            vertex_buffer = vertex_buffer_;
-            vertex_count = vertex_count_;
+            for (size_t stream = 1; stream < max_vertex_streams; ++stream)
+            {
+                vertex_streams[stream].data = 0;
+            }
+            vertex_streams[0].data = static_cast<const unsigned char*>(vertex_buffer_);
+            vertex_streams[0].vertex_count = vertex_count_;
+            vertex_streams[0].layout = VertexLayout();
         }
 
-        void setIndexBuffer(uint16_t* index_buffer_, size_t triangle_count_)
+        // Vertex buffer of one stream, attributes of all set streams are loaded for every vertex.
+        // The vertex count of the draw is the smallest vertex count of the set streams, 0 data clears the stream.
+        void setVertexBuffer(size_t stream, const void* vertex_buffer_, size_t vertex_count_, const VertexLayout& layout)
         {
-            index_buffer = index_buffer_;
-            triangle_count = triangle_count_;
+            if (stream >= max_vertex_streams || layout.empty())
+            {
+                std::cerr << "Wrong vertex stream " << stream << " or empty vertex layout" << std::endl;
+                assert(false);
+                return;
+            }
+            vertex_streams[stream].data = static_cast<const unsigned char*>(vertex_buffer_);
+            vertex_streams[stream].vertex_count = vertex_count_;
+            vertex_streams[stream].layout = layout;
         }
 
-        void render()
+        // Draws triangle_count triangles of the index buffer
+        void setIndexBuffer(const uint16_t* index_buffer_, size_t triangle_count_)
         {
-            if (!index_buffer || !triangle_count)
+            setIndexBuffer(index_buffer_, 0, triangle_count_ * 3, 0);
+        }
+
+        void setIndexBuffer(const uint32_t* index_buffer_, size_t triangle_count_)
+        {
+            setIndexBuffer(index_buffer_, 0, triangle_count_ * 3, 0);
+        }
+
+        // Draws index_count indices starting at first_index_, base_vertex_ is added to every index
+        void setIndexBuffer(const uint16_t* index_buffer_, size_t first_index_, size_t index_count, int base_vertex_ = 0)
+        {
+            setDrawRange(index_buffer_, false, first_index_, index_count, base_vertex_);
+        }
+
+        void setIndexBuffer(const uint32_t* index_buffer_, size_t first_index_, size_t index_count, int base_vertex_ = 0)
+        {
+            setDrawRange(index_buffer_, true, first_index_, index_count, base_vertex_);
+        }
+
+        // Per instance attributes, e.g. i_data0 - i_data3 of bgfx shaders, one element of the layout per instance.
+        // The draw is repeated for every instance: vertices are shaded once per instance and triangles are drawn
+        // instance by instance. 0 data disables instancing.
+        void setInstanceDataBuffer(const void* instance_data_, size_t instance_count_, const VertexLayout& layout)
+        {
+            if (instance_data_ && layout.empty())
             {
-                std::cerr << "Index buffer is not specified or triangle count is zero" << std::endl;
+                std::cerr << "Instance data layout is empty" << std::endl;
                 assert(false);
                 return;
             }
+            instance_data = static_cast<const unsigned char*>(instance_data_);
+            instance_count = instance_count_;
+            instance_layout = layout;
+        }
 
-            if (!vertex_buffer || !vertex_count)
+        // thread_count == 0 uses one thread per hardware thread
+        void setRenderMode(RenderMode render_mode_, size_t tile_size_ = 64, size_t thread_count_ = 0)
+        {
+            if (tile_size_ == 0)
             {
-                std::cerr << "Vertex buffer is not specified or vertex count is zero" << std::endl;
+                std::cerr << "Tile size must be positive" << std::endl;
+                assert(false);
+                return;
+            }
+            render_mode = render_mode_;
+            tile_size = tile_size_;
+            if (thread_count != thread_count_)
+            {
+                thread_pool.reset();
+            }
+            thread_count = thread_count_;
+        }
+
+        // Maps normalized device coordinates to the window rectangle, the origin is the bottom left corner.
+        // The rectangle may extend past the framebuffer, only pixels inside of it are written.
+        void setViewRect(int x, int y, unsigned width_, unsigned height_)
+        {
+            if (width_ == 0 || height_ == 0 || width_ > static_cast<unsigned>(guard_band) || height_ > static_cast<unsigned>(guard_band))
+            {
+                std::cerr << "View rect size must be in [1, " << guard_band << "]" << std::endl;
                 assert(false);
                 return;
             }
+            view_x = x;
+            view_y = y;
+            view_width = width_;
+            view_height = height_;
+        }
+
+        // Pixels outside of the scissor rectangle are not written, zero width or height disables the scissor test
+        void setScissor(int x, int y, unsigned width_, unsigned height_)
+        {
+            scissor_x = x;
+            scissor_y = y;
+            scissor_width = width_;
+            scissor_height = height_;
+        }
+
+        void setShadingMode(ShadingMode shading_mode_)
+        {
+            shading_mode = shading_mode_;
+        }
+
+        void setCullMode(CullMode cull_mode_)
+        {
+            cull_mode = cull_mode_;
+        }
+
+        const CullStats& getCullStats() const
+        {
+            return cull_stats;
+        }
+
+        Stats getStats() const
+        {
+            Stats result = stats;
+            result.triangles_culled = cull_stats.frustum + cull_stats.zero_area + cull_stats.back_face;
+            result.output_ns = output_ns;
+            return result;
+        }
 
-            vertex_size = input_attributes.getAttributesSize();
-            if (vertex_size == 0)
+#if defined(BGFX_SHADER_TRACE)
+        // Starts a new trace of renders, frames, draws, their stages and the jobs of the thread pool. Every thread
+        // keeps its latest events_per_thread events. Frames of frameAsync() are traced by the renderers holding them.
+        void startTrace(size_t events_per_thread = 65536)
+        {
+            if (!events_per_thread)
             {
-                std::cerr << "Input Vertex buffer attributes are empty!" << std::endl;
+                std::cerr << "Trace needs room for at least one event per thread" << std::endl;
                 assert(false);
                 return;
             }
+            trace.reset(new Trace(events_per_thread));
+            trace->addThreads(thread_pool ? 1 + thread_pool->getThreadCount() : 1);
+            tracing = true;
+        }
 
-            for (size_t triangle_index = 0; triangle_index < triangle_count; ++triangle_index)
-            {
-                uint16_t triangle[3];
-                triangle[0] = index_buffer[triangle_index * 3 + 0];
-                triangle[1] = index_buffer[triangle_index * 3 + 1];
-                triangle[2] = index_buffer[triangle_index * 3 + 2];
-
-                Attributes first_vertex_output_data;
-                vec4 first_gl_position;
-                processVertex(triangle[0], first_vertex_output_data, first_gl_position);
-
-                Attributes second_vertex_output_data;
-                vec4 second_gl_position;
-                processVertex(triangle[1], second_vertex_output_data, second_gl_position);
-
-                Attributes third_vertex_output_data;
-                vec4 third_gl_position;
-                processVertex(triangle[2], third_vertex_output_data, third_gl_position);
-
-                vec2 v0(first_gl_position.x, first_gl_position.y);
-                vec2 v1(second_gl_position.x, second_gl_position.y);
-                vec2 v2(third_gl_position.x, third_gl_position.y);
-                vec2 v0v1 = normalize(v1 - v0);
-                vec2 v0v2 = normalize(v2 - v0);
-                vec3 v0v1_3d(v0v1.x, v0v1.y, 0.0f);
-                vec3 v0v2_3d(v0v2.x, v0v2.y, 0.0f);
-                vec3 n = cross(v0v1_3d, v0v2_3d);
-                vec3 new_v0v2_3d = normalize(cross(n, v0v1_3d));
-                v0v2.x = new_v0v2_3d.x;
-                v0v2.y = new_v0v2_3d.y;
-                float v0v1_length = length(v1 - v0);
-                float v0v2_length = dot((v2 - v0), v0v2);
-                assert(v0v1_length > 0.0f);
-                assert(v0v2_length > 0.0f);
-
-                vec2 bbox_min, bbox_max;
-                bbox_min.x = std::min<float>(std::min<float>(first_gl_position.x, second_gl_position.x), third_gl_position.x);
-                bbox_min.y = std::min<float>(std::min<float>(first_gl_position.y, second_gl_position.y), third_gl_position.y);
-                bbox_max.x = std::max<float>(std::max<float>(first_gl_position.x, second_gl_position.x), third_gl_position.x);
-                bbox_max.y = std::max<float>(std::max<float>(first_gl_position.y, second_gl_position.y), third_gl_position.y);
-
-                int min_x = static_cast<int>(bbox_min.x);
-                int min_y = static_cast<int>(bbox_min.y);
-                int max_x = static_cast<int>(bbox_max.x);
-                int max_y = static_cast<int>(bbox_max.y);
-                for (int x = min_x; x <= max_x; ++x)
-                {
-                    for (int y = min_y; y <= max_y; ++y)
-                    {
-                        int screen_x = xToScreen(x);
-                        int screen_y = yToScreen(y);
-                        if (insideScreen(screen_x, screen_y))
-                        {
-                            vec2 cur_point(static_cast<float>(x), static_cast<float>(y));
-                            if (pointInTriangle(cur_point, v0, v1, v2))
-                            {
-                                vec2 v = cur_point - v0;
-                                float rx = dot(v, v0v1);
-                                float ry = dot(v, v0v2);
-                                assert(rx >= 0.0f);
-                                assert(ry >= 0.0f);
-                                float nx = rx / v0v1_length;
-                                float ny = ry / v0v2_length;
-                                float interim_z = mix(first_gl_position.z, second_gl_position.z, nx);
-                                float result_z = mix(interim_z, third_gl_position.z, ny);
-                                if (result_z < zBuffer(screen_x, screen_y))
-                                {
-                                    zBuffer(screen_x, screen_y) = result_z;
+        // Stops recording, the recorded events are kept for saveTrace()
+        void stopTrace()
+        {
+            tracing = false;
+        }
+
+        // Chrome trace event JSON of the events recorded since startTrace(), for chrome://tracing or ui.perfetto.dev
+        void saveTrace(const std::string& file_name) const
+        {
+            if (!trace)
+            {
+                std::cerr << "Trace is not started" << std::endl;
+                assert(false);
+                return;
+            }
+            trace->save(file_name);
+        }
+#endif
 
-                                    Attributes interim_vertex_output_data = first_vertex_output_data.interpolate(second_vertex_output_data, nx);
-                                    Attributes result_vertex_output_data = interim_vertex_output_data.interpolate(third_vertex_output_data, ny);
+        // Uniforms are taken from the program at render() time
+        void setProgram(const ShaderContext& program_)
+        {
+            program = &program_;
+        }
 
-                                    result_vertex_output_data.loadVarying(); // Set vertex shader outputs / fragment shader inputs
-                                    fragment_shader_main(); // Call fragment shader for the current pixel with interpolated attribute values
+        // Optional per lane variant of the program's fragment shader, used for all pixels when set.
+        // Predefined uniforms are copied from the program, uniforms declared by the shader must be set on both.
+        void setLaneProgram(const LaneShaderContext& lane_program_)
+        {
+            lane_program = &lane_program_;
+        }
 
-                                    rBuffer(screen_x, screen_y) = static_cast<unsigned char>(gl_FragColor.r * 255.0f);
-                                    gBuffer(screen_x, screen_y) = static_cast<unsigned char>(gl_FragColor.g * 255.0f);
-                                    bBuffer(screen_x, screen_y) = static_cast<unsigned char>(gl_FragColor.b * 255.0f);
-                                    aBuffer(screen_x, screen_y) = static_cast<unsigned char>(gl_FragColor.a * 255.0f);
-                                }
-                            }
-                        }
-                    }
+        // Draws with the current state right away
+        void render()
+        {
+            BGFX_SHADER_TRACE_SCOPE(getTraceBuffer(0), "render", -1);
+            const uint64_t start_time = getTime();
+            resetStats();
+            beginDraws();
+            executeDraw();
+            resolveVisibility();
+            stats.frame_ns = getTime() - start_time;
+        }
+
+        // Queues a draw with the current state: buffers, programs with their uniforms, attributes, cull mode,
+        // viewport and scissor. Buffers and the textures of samplers are referenced, not copied, and must stay valid
+        // until frame() returns or the future returned by frameAsync() is ready.
+        // depth orders the draws of a frame, e.g. the view space distance of the mesh mapped to an integer.
+        void submit(uint32_t depth = 0)
+        {
+            if (!program)
+            {
+                std::cerr << "Shader program is not specified" << std::endl;
+                assert(false);
+                return;
+            }
+            draws.emplace_back();
+            Draw& draw = draws.back();
+            saveDrawState(draw);
+            draw.program_copy = program->clone();
+            draw.program = draw.program_copy.get();
+            if (lane_program)
+            {
+                draw.lane_program_copy = lane_program->clone();
+                draw.lane_program = draw.lane_program_copy.get();
+            }
+            draw.depth = depth;
+        }
+
+        // Executes the draws queued by submit() sorted by their 64-bit keys: depth in the high half, so opaque draws
+        // go front to back and the depth test rejects more, then program, so draws of a program run together.
+        // Draws with equal keys keep their submission order. The current state is left unchanged.
+        // getCullStats() and getStats() sum all draws of the frame.
+        void frame()
+        {
+            BGFX_SHADER_TRACE_SCOPE(getTraceBuffer(0), "frame", -1);
+            const uint64_t start_time = getTime();
+            resetStats();
+
+            // Programs are numbered in the order of their first submission
+            std::vector<const ShaderContext*> programs;
+            std::vector<std::pair<uint64_t, size_t>> keys(draws.size());
+            for (size_t i = 0; i < draws.size(); ++i)
+            {
+                const ShaderContext* draw_program = draws[i].submitted_program;
+                const size_t program_index = std::find(programs.begin(), programs.end(), draw_program) - programs.begin();
+                if (program_index == programs.size())
+                {
+                    programs.push_back(draw_program);
                 }
+                keys[i] = std::make_pair((static_cast<uint64_t>(draws[i].depth) << 32) | program_index, i);
+            }
+            std::stable_sort(keys.begin(), keys.end(), [](const std::pair<uint64_t, size_t>& a, const std::pair<uint64_t, size_t>& b)
+            {
+                return a.first < b.first;
+            });
+
+            Draw current;
+            saveDrawState(current);
+            beginDraws();
+            for (size_t i = 0; i < keys.size(); ++i)
+            {
+                restoreDrawState(draws[keys[i].second]);
+                executeDraw();
             }
+            resolveVisibility();
+            restoreDrawState(current);
+            draws.clear();
+            stats.frame_ns = getTime() - start_time;
         }
 
-        void saveToPPM(const std::string& file_name) const
+        // Number of framebuffers frameAsync() rotates through, at least 2. Waits for the frames in flight.
+        void setFramebufferCount(size_t framebuffer_count_)
+        {
+            if (framebuffer_count_ < 2)
+            {
+                std::cerr << "At least 2 framebuffers are needed" << std::endl;
+                assert(false);
+                return;
+            }
+            finishAsyncFrames();
+            framebuffer_count = framebuffer_count_;
+            framebuffers.clear();
+        }
+
+        // Same as frame(), but the draws are executed on a render thread and the call returns at once, so the next
+        // frame can be submitted meanwhile. Every frame starts cleared and is rendered into the next framebuffer in turn.
+        // The future becomes ready when the frame is finished and gives the renderer holding it, to read its pixels
+        // and stats. Its pixels stay valid until frameAsync() is called framebuffer_count more times, so with
+        // 2 framebuffers frame N - 1 can be written out while frame N renders, before frame N + 1 is started.
+        // Render settings (render mode, tile size, threads, shading mode, tracing) are taken at the call.
+        // The render thread reads the buffers and textures of the submitted draws after the call returns, they must
+        // stay valid until the future is ready.
+        std::shared_future<const CPURendering*> frameAsync()
+        {
+            if (framebuffers.empty())
+            {
+                for (size_t i = 0; i < framebuffer_count; ++i)
+                {
+                    framebuffers.push_back(std::unique_ptr<CPURendering>(new CPURendering(static_cast<unsigned>(width), static_cast<unsigned>(height), depth_format)));
+                }
+            }
+            if (!render_thread.joinable())
+            {
+                render_thread = std::thread(&CPURendering::renderThreadMain, this);
+            }
+
+            CPURendering* target = framebuffers[async_frame_count++ % framebuffer_count].get();
+            const RenderMode frame_render_mode = render_mode;
+            const size_t frame_tile_size = tile_size;
+            const size_t frame_thread_count = thread_count;
+            const ShadingMode frame_shading_mode = shading_mode;
+#if defined(BGFX_SHADER_TRACE)
+            const size_t frame_trace_events = tracing ? trace->getEventsPerThread() : 0;
+#endif
+            std::shared_ptr<std::vector<Draw>> frame_draws(new std::vector<Draw>(std::move(draws)));
+            draws.clear();
+            std::shared_ptr<std::packaged_task<const CPURendering*()>> task(new std::packaged_task<const CPURendering*()>([=]()
+            {
+                target->setRenderMode(frame_render_mode, frame_tile_size, frame_thread_count);
+                target->setShadingMode(frame_shading_mode);
+#if defined(BGFX_SHADER_TRACE)
+                if (!frame_trace_events)
+                {
+                    target->stopTrace();
+                }
+                else if (!target->tracing)
+                {
+                    target->startTrace(frame_trace_events);
+                }
+#endif
+                target->clear();
+                target->draws.swap(*frame_draws);
+                target->frame();
+                return static_cast<const CPURendering*>(target);
+            }));
+            std::shared_future<const CPURendering*> result = task->get_future().share();
+            {
+                std::lock_guard<std::mutex> lock(render_mutex);
+                render_jobs.push_back([task]() { (*task)(); });
+            }
+            render_wake_up.notify_all();
+            return result;
+        }
+
+        // Pool of RenderMode::Tiled, also used by saveToPNG(). Created on first use with thread_count threads,
+        // one per hardware thread if it is 0, and kept until the thread count changes.
+        ThreadPool& getThreadPool() const
+        {
+            if (!thread_pool)
+            {
+                thread_pool.reset(new ThreadPool(thread_count ? thread_count : std::max(1u, std::thread::hardware_concurrency())));
+            }
+            return *thread_pool;
+        }
+
+        // Drops the alpha of 4 RGBA8 pixels, reading 16 bytes and writing 12 as 32-bit words
+        static void packRGB(const unsigned char* rgba, unsigned char* rgb)
+        {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            for (int i = 0; i < 4; ++i)
+            {
+                std::memcpy(rgb + i * 3, rgba + i * 4, 3);
+            }
+#else
+            uint32_t texels[4];
+            std::memcpy(texels, rgba, sizeof(texels));
+            const uint32_t packed[3] =
+            {
+                (texels[0] & 0xffffff) | (texels[1] << 24),
+                ((texels[1] >> 8) & 0xffff) | (texels[2] << 16),
+                ((texels[2] >> 16) & 0xff) | (texels[3] << 8)
+            };
+            std::memcpy(rgb, packed, sizeof(packed));
+#endif
+        }
+
+        // Copies the color buffer in linear order: 3 components drop alpha, top_down starts from the top row.
+        // Rows of blocks are copied in parallel once the thread pool of RenderMode::Tiled exists.
+        void resolve(unsigned char* pixels, size_t components, bool top_down) const
         {
-            std::ofstream out_file(file_name);
-            out_file << "P3\n";
-            out_file << width << " " << height << "\n";
-            out_file << "255\n";
-            for (int y = static_cast<int>(height) - 1; y >= 0; --y)
+            const size_t block_rows = (height + block_size - 1) / block_size;
+            const auto resolve_block_row = [&](size_t block_y, size_t)
             {
-                for (int x = 0; static_cast<unsigned>(x) < width; ++x)
+                const size_t max_y = std::min((block_y + 1) * block_size, height);
+                for (size_t y = block_y * block_size; y < max_y; ++y)
                 {
-                    out_file << static_cast<int>(rBuffer(x, y)) << " " << static_cast<int>(gBuffer(x, y)) << " " << static_cast<int>(bBuffer(x, y)) << " ";
+                    unsigned char* row = pixels + (top_down ? height - 1 - y : y) * width * components;
+                    for (size_t x = 0; x < width; x += block_size)
+                    {
+                        const size_t pixel_count = std::min(static_cast<size_t>(block_size), width - x);
+                        const unsigned char* block_row = &rgba_buffer[pixelIndex(static_cast<int>(x), static_cast<int>(y)) * 4];
+                        if (components == 4)
+                        {
+                            std::memcpy(row + x * 4, block_row, pixel_count * 4);
+                            continue;
+                        }
+                        // Block rows are padded to block_size pixels, a partial one at the right edge is packed aside
+                        unsigned char partial[block_size * 3];
+                        unsigned char* rgb = pixel_count == block_size ? row + x * 3 : partial;
+                        for (int i = 0; i < block_size; i += 4)
+                        {
+                            packRGB(block_row + i * 4, rgb + i * 3);
+                        }
+                        if (rgb == partial)
+                        {
+                            std::memcpy(row + x * 3, partial, pixel_count * 3);
+                        }
+                    }
                 }
-                out_file << "\n";
+            };
+            if (thread_pool)
+            {
+                thread_pool->run(block_rows, resolve_block_row);
+                return;
             }
+            for (size_t block_y = 0; block_y < block_rows; ++block_y)
+            {
+                resolve_block_row(block_y, 0);
+            }
+        }
+
+        // RGBA8 pixels in linear order, rows from the bottom to the top
+        void readPixels(std::vector<unsigned char>& rgba) const
+        {
+            BGFX_SHADER_TRACE_SCOPE(getTraceBuffer(0), "output", -1);
+            const uint64_t start_time = getTime();
+            rgba.resize(width * height * 4);
+            resolve(rgba.data(), 4, false);
+            output_ns += getTime() - start_time;
+        }
+
+        // Binary P6 PPM
+        void saveToPPM(const std::string& file_name) const
+        {
+            BGFX_SHADER_TRACE_SCOPE(getTraceBuffer(0), "output", -1);
+            const uint64_t start_time = getTime();
+            std::vector<unsigned char> rgb(width * height * 3);
+            resolve(rgb.data(), 3, true);
+            savePPM(file_name, rgb.data(), width, height);
+            output_ns += getTime() - start_time;
+        }
+
+        // RGB PNG, encoded in parallel by the pool of getThreadPool(), which later saves and tiled draws reuse
+        void saveToPNG(const std::string& file_name) const
+        {
+            BGFX_SHADER_TRACE_SCOPE(getTraceBuffer(0), "output", -1);
+            const uint64_t start_time = getTime();
+            ThreadPool& pool = getThreadPool();
+            std::vector<unsigned char> rgb(width * height * 3);
+            resolve(rgb.data(), 3, true);
+            savePNG(file_name, rgb.data(), width, height, &pool);
+            output_ns += getTime() - start_time;
         }
     };
 }
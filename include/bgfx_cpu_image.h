@@ -0,0 +1,461 @@
+// Copyright (c) 2019 Petr Petrov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "bgfx_cpu_thread_pool.h"
+
+// Writers of 8-bit RGB images, pixels are passed row by row starting from the top row
+namespace BGFXShaderCPUEmulator
+{
+    // Deflate (RFC 1951) with the fixed Huffman codes and greedy LZ77 matching.
+    // Parts compressed independently end on a byte boundary, so they concatenate into one stream.
+    class DeflateEncoder
+    {
+        static const size_t window_size = 32768;
+        static const size_t hash_size = 1 << 15;
+        static const unsigned max_chain = 32;
+        static const unsigned min_match = 3;
+        static const unsigned max_match = 258;
+
+        std::vector<unsigned char>& out;
+        uint64_t bit_buffer;
+        unsigned bit_count;
+
+        // Bits are packed starting from the least significant one
+        void writeBits(uint32_t bits, unsigned count)
+        {
+            bit_buffer |= static_cast<uint64_t>(bits) << bit_count;
+            bit_count += count;
+            while (bit_count >= 8)
+            {
+                out.push_back(static_cast<unsigned char>(bit_buffer));
+                bit_buffer >>= 8;
+                bit_count -= 8;
+            }
+        }
+
+        // Huffman codes are packed starting from the most significant bit
+        void writeCode(uint32_t code, unsigned length)
+        {
+            uint32_t reversed = 0;
+            for (unsigned i = 0; i < length; ++i)
+            {
+                reversed |= ((code >> i) & 1u) << (length - 1 - i);
+            }
+            writeBits(reversed, length);
+        }
+
+        void writeLiteralLength(unsigned symbol)
+        {
+            if (symbol < 144)
+            {
+                writeCode(0x30 + symbol, 8);
+            }
+            else if (symbol < 256)
+            {
+                writeCode(0x190 + symbol - 144, 9);
+            }
+            else if (symbol < 280)
+            {
+                writeCode(symbol - 256, 7);
+            }
+            else
+            {
+                writeCode(0xc0 + symbol - 280, 8);
+            }
+        }
+
+        void writeMatch(unsigned length, unsigned distance)
+        {
+            static const unsigned short length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+            static const unsigned char length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+            static const unsigned short distance_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+            static const unsigned char distance_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+            int code = 28;
+            while (length_base[code] > length)
+            {
+                --code;
+            }
+            writeLiteralLength(257 + code);
+            writeBits(length - length_base[code], length_extra[code]);
+
+            code = 29;
+            while (distance_base[code] > distance)
+            {
+                --code;
+            }
+            writeCode(code, 5);
+            writeBits(distance - distance_base[code], distance_extra[code]);
+        }
+
+        static size_t hash(const unsigned char* data)
+        {
+            return ((data[0] << 10) ^ (data[1] << 5) ^ data[2]) & (hash_size - 1);
+        }
+
+    public:
+        explicit DeflateEncoder(std::vector<unsigned char>& out_) : out(out_), bit_buffer(0), bit_count(0)
+        {
+        }
+
+        // Appends one block with the data, last marks the final block of the stream
+        void compress(const unsigned char* data, size_t size, bool last)
+        {
+            writeBits(last ? 1 : 0, 1);
+            writeBits(1, 2); // Fixed Huffman codes
+
+            std::vector<int64_t> head(hash_size, -1);
+            std::vector<int64_t> previous(window_size, -1);
+            const auto insert = [&](size_t position)
+            {
+                const size_t key = hash(data + position);
+                previous[position & (window_size - 1)] = head[key];
+                head[key] = static_cast<int64_t>(position);
+            };
+
+            size_t position = 0;
+            while (position < size)
+            {
+                unsigned best_length = 0;
+                size_t best_distance = 0;
+                if (position + min_match <= size)
+                {
+                    const size_t max_length = std::min(static_cast<size_t>(max_match), size - position);
+                    int64_t candidate = head[hash(data + position)];
+                    for (unsigned chain = 0; chain < max_chain && candidate >= 0; ++chain)
+                    {
+                        const size_t distance = position - static_cast<size_t>(candidate);
+                        if (distance == 0 || distance > window_size)
+                        {
+                            break;
+                        }
+                        unsigned length = 0;
+                        while (length < max_length && data[candidate + length] == data[position + length])
+                        {
+                            ++length;
+                        }
+                        if (length > best_length)
+                        {
+                            best_length = length;
+                            best_distance = distance;
+                            if (length == max_length)
+                            {
+                                break;
+                            }
+                        }
+                        candidate = previous[candidate & (window_size - 1)];
+                    }
+                    insert(position);
+                }
+
+                if (best_length >= min_match)
+                {
+                    writeMatch(best_length, static_cast<unsigned>(best_distance));
+                    for (size_t i = 1; i < best_length; ++i)
+                    {
+                        if (position + i + min_match <= size)
+                        {
+                            insert(position + i);
+                        }
+                    }
+                    position += best_length;
+                }
+                else
+                {
+                    writeLiteralLength(data[position]);
+                    ++position;
+                }
+            }
+            writeLiteralLength(256); // End of block
+
+            if (!last)
+            {
+                // Empty stored block, aligns the stream to a byte boundary
+                writeBits(0, 3);
+                if (bit_count)
+                {
+                    writeBits(0, 8 - bit_count);
+                }
+                writeBits(0x0000, 16);
+                writeBits(0xffff, 16);
+            }
+            else if (bit_count)
+            {
+                writeBits(0, 8 - bit_count);
+            }
+        }
+    };
+
+    inline uint32_t crc32(const unsigned char* data, size_t size, uint32_t crc = 0)
+    {
+        static const std::vector<uint32_t> table = []
+        {
+            std::vector<uint32_t> values(256);
+            for (uint32_t i = 0; i < 256; ++i)
+            {
+                uint32_t value = i;
+                for (int bit = 0; bit < 8; ++bit)
+                {
+                    value = (value & 1) ? 0xedb88320u ^ (value >> 1) : value >> 1;
+                }
+                values[i] = value;
+            }
+            return values;
+        }();
+
+        crc = ~crc;
+        for (size_t i = 0; i < size; ++i)
+        {
+            crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+    inline uint32_t adler32(const unsigned char* data, size_t size)
+    {
+        const uint32_t base = 65521;
+        const size_t max_run = 5552; // Longest run without overflow of the sums
+        uint32_t a = 1;
+        uint32_t b = 0;
+        while (size)
+        {
+            const size_t run = std::min(size, max_run);
+            for (size_t i = 0; i < run; ++i)
+            {
+                a += data[i];
+                b += a;
+            }
+            a %= base;
+            b %= base;
+            data += run;
+            size -= run;
+        }
+        return (b << 16) | a;
+    }
+
+    // Adler-32 of the concatenation of two parts, from the checksums of both and the size of the second one
+    inline uint32_t adler32Combine(uint32_t adler1, uint32_t adler2, size_t size2)
+    {
+        const uint32_t base = 65521;
+        const uint32_t remainder = static_cast<uint32_t>(size2 % base);
+        uint32_t a = adler1 & 0xffff;
+        uint32_t b = static_cast<uint32_t>((static_cast<uint64_t>(remainder) * a) % base);
+        a += (adler2 & 0xffff) + base - 1;
+        b += (adler1 >> 16) + (adler2 >> 16) + base - remainder;
+        a = a % base;
+        b = b % base;
+        return (b << 16) | a;
+    }
+
+    // Binary P6 PPM, written in one bulk write
+    inline void savePPM(const std::string& file_name, const unsigned char* rgb, size_t width, size_t height)
+    {
+        std::ofstream out_file(file_name, std::ios::binary);
+        if (!out_file)
+        {
+            std::cerr << "Can't open " << file_name << std::endl;
+            return;
+        }
+        out_file << "P6\n" << width << " " << height << "\n255\n";
+        out_file.write(reinterpret_cast<const char*>(rgb), static_cast<std::streamsize>(width * height * 3));
+    }
+
+    // PNG with a per row adaptive filter. Bands of rows are filtered and deflated in parallel when a pool is given,
+    // every band becomes one IDAT chunk.
+    inline void savePNG(const std::string& file_name, const unsigned char* rgb, size_t width, size_t height, ThreadPool* pool)
+    {
+        const size_t row_size = width * 3;
+        const size_t band_rows = std::max(static_cast<size_t>(1), (static_cast<size_t>(1) << 20) / (row_size + 1));
+        const size_t band_count = (height + band_rows - 1) / band_rows;
+
+        struct Band
+        {
+            std::vector<unsigned char> chunk; // Length, type, compressed data and CRC of the IDAT chunk
+            uint32_t adler;
+            size_t filtered_size;
+        };
+        std::vector<Band> bands(band_count);
+
+        const auto encode_band = [&](size_t band_index, size_t)
+        {
+            Band& band = bands[band_index];
+            const size_t first_row = band_index * band_rows;
+            const size_t row_count = std::min(band_rows, height - first_row);
+
+            // Every row is filtered with all five filters, the one with the smallest sum of absolute values is kept
+            std::vector<unsigned char> filtered(row_count * (row_size + 1));
+            std::vector<unsigned char> candidates(5 * row_size);
+            for (size_t row = 0; row < row_count; ++row)
+            {
+                const unsigned char* current = rgb + (first_row + row) * row_size;
+                const unsigned char* above = first_row + row > 0 ? current - row_size : 0;
+                unsigned best_filter = 0;
+                uint64_t best_sum = UINT64_MAX;
+                for (unsigned filter = 0; filter < 5; ++filter)
+                {
+                    unsigned char* candidate = &candidates[filter * row_size];
+                    uint64_t sum = 0;
+                    for (size_t i = 0; i < row_size; ++i)
+                    {
+                        const int left = i >= 3 ? current[i - 3] : 0;
+                        const int up = above ? above[i] : 0;
+                        const int up_left = above && i >= 3 ? above[i - 3] : 0;
+                        int prediction = 0;
+                        switch (filter)
+                        {
+                        case 1:
+                            prediction = left;
+                            break;
+                        case 2:
+                            prediction = up;
+                            break;
+                        case 3:
+                            prediction = (left + up) / 2;
+                            break;
+                        case 4:
+                        {
+                            const int estimate = left + up - up_left;
+                            const int distance_left = std::abs(estimate - left);
+                            const int distance_up = std::abs(estimate - up);
+                            const int distance_up_left = std::abs(estimate - up_left);
+                            prediction = distance_left <= distance_up && distance_left <= distance_up_left ? left : distance_up <= distance_up_left ? up : up_left;
+                            break;
+                        }
+                        default:
+                            break;
+                        }
+                        candidate[i] = static_cast<unsigned char>(current[i] - prediction);
+                        sum += static_cast<uint64_t>(std::abs(static_cast<int>(static_cast<signed char>(candidate[i]))));
+                    }
+                    if (sum < best_sum)
+                    {
+                        best_sum = sum;
+                        best_filter = filter;
+                    }
+                }
+                unsigned char* out_row = &filtered[row * (row_size + 1)];
+                out_row[0] = static_cast<unsigned char>(best_filter);
+                std::copy(candidates.begin() + best_filter * row_size, candidates.begin() + (best_filter + 1) * row_size, out_row + 1);
+            }
+            band.adler = adler32(filtered.data(), filtered.size());
+            band.filtered_size = filtered.size();
+
+            band.chunk.assign(8, 0);
+            band.chunk[4] = 'I';
+            band.chunk[5] = 'D';
+            band.chunk[6] = 'A';
+            band.chunk[7] = 'T';
+            if (band_index == 0)
+            {
+                band.chunk.push_back(0x78); // zlib header: deflate with a 32K window, no dictionary
+                band.chunk.push_back(0x01);
+            }
+            DeflateEncoder encoder(band.chunk);
+            encoder.compress(filtered.data(), filtered.size(), band_index + 1 == band_count);
+
+            const uint32_t length = static_cast<uint32_t>(band.chunk.size() - 8);
+            for (int i = 0; i < 4; ++i)
+            {
+                band.chunk[i] = static_cast<unsigned char>(length >> (24 - 8 * i));
+            }
+            const uint32_t crc = crc32(&band.chunk[4], band.chunk.size() - 4);
+            for (int i = 0; i < 4; ++i)
+            {
+                band.chunk.push_back(static_cast<unsigned char>(crc >> (24 - 8 * i)));
+            }
+        };
+        if (pool)
+        {
+            pool->run(band_count, encode_band);
+        }
+        else
+        {
+            for (size_t band_index = 0; band_index < band_count; ++band_index)
+            {
+                encode_band(band_index, 0);
+            }
+        }
+
+        const auto append_chunk = [](std::vector<unsigned char>& out, const char* type, const std::vector<unsigned char>& data)
+        {
+            const uint32_t length = static_cast<uint32_t>(data.size());
+            for (int i = 0; i < 4; ++i)
+            {
+                out.push_back(static_cast<unsigned char>(length >> (24 - 8 * i)));
+            }
+            const size_t type_offset = out.size();
+            out.insert(out.end(), type, type + 4);
+            out.insert(out.end(), data.begin(), data.end());
+            const uint32_t crc = crc32(&out[type_offset], out.size() - type_offset);
+            for (int i = 0; i < 4; ++i)
+            {
+                out.push_back(static_cast<unsigned char>(crc >> (24 - 8 * i)));
+            }
+        };
+
+        std::vector<unsigned char> header = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        std::vector<unsigned char> image_header(13, 0);
+        for (int i = 0; i < 4; ++i)
+        {
+            image_header[i] = static_cast<unsigned char>(width >> (24 - 8 * i));
+            image_header[4 + i] = static_cast<unsigned char>(height >> (24 - 8 * i));
+        }
+        image_header[8] = 8; // Bits per component
+        image_header[9] = 2; // RGB
+        append_chunk(header, "IHDR", image_header);
+
+        // The Adler-32 of the zlib stream closes the data, in a chunk of its own as it depends on all bands
+        uint32_t adler = 1;
+        for (size_t band_index = 0; band_index < band_count; ++band_index)
+        {
+            adler = adler32Combine(adler, bands[band_index].adler, bands[band_index].filtered_size);
+        }
+        std::vector<unsigned char> trailer;
+        std::vector<unsigned char> checksum(4);
+        for (int i = 0; i < 4; ++i)
+        {
+            checksum[i] = static_cast<unsigned char>(adler >> (24 - 8 * i));
+        }
+        append_chunk(trailer, "IDAT", checksum);
+        append_chunk(trailer, "IEND", std::vector<unsigned char>());
+
+        std::ofstream out_file(file_name, std::ios::binary);
+        if (!out_file)
+        {
+            std::cerr << "Can't open " << file_name << std::endl;
+            return;
+        }
+        out_file.write(reinterpret_cast<const char*>(header.data()), static_cast<std::streamsize>(header.size()));
+        for (size_t band_index = 0; band_index < band_count; ++band_index)
+        {
+            out_file.write(reinterpret_cast<const char*>(bands[band_index].chunk.data()), static_cast<std::streamsize>(bands[band_index].chunk.size()));
+        }
+        out_file.write(reinterpret_cast<const char*>(trailer.data()), static_cast<std::streamsize>(trailer.size()));
+    }
+}
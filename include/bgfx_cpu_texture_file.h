@@ -0,0 +1,325 @@
+// Copyright (c) 2019 Petr Petrov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "bgfx_shader_texture.h"
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Loading of uncompressed KTX and DDS textures with their precomputed mips. Files are mapped into memory and sampled
+// in place: loading reads only the headers, texel pages are read by the OS when a sampler touches them first.
+namespace BGFXShaderCPUEmulator
+{
+    // Read only mapping of a whole file, unmapped when the last copy of the pointer is gone
+    inline std::shared_ptr<const unsigned char> mapFile(const std::string& file_name, size_t& size)
+    {
+        size = 0;
+#if defined(_WIN32)
+        HANDLE file = CreateFileA(file_name.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            std::cerr << "Can't open " << file_name << std::endl;
+            return std::shared_ptr<const unsigned char>();
+        }
+        LARGE_INTEGER file_size;
+        HANDLE mapping = GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0 ? CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0) : 0;
+        const void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : 0;
+        if (mapping)
+        {
+            CloseHandle(mapping); // The view keeps the mapping alive
+        }
+        CloseHandle(file);
+        if (!view)
+        {
+            std::cerr << "Can't map " << file_name << std::endl;
+            return std::shared_ptr<const unsigned char>();
+        }
+        size = static_cast<size_t>(file_size.QuadPart);
+        return std::shared_ptr<const unsigned char>(static_cast<const unsigned char*>(view), [](const unsigned char* data)
+        {
+            UnmapViewOfFile(data);
+        });
+#else
+        const int file = open(file_name.c_str(), O_RDONLY);
+        if (file < 0)
+        {
+            std::cerr << "Can't open " << file_name << std::endl;
+            return std::shared_ptr<const unsigned char>();
+        }
+        struct stat file_status;
+        void* view = fstat(file, &file_status) == 0 && file_status.st_size > 0 ?
+            mmap(0, static_cast<size_t>(file_status.st_size), PROT_READ, MAP_PRIVATE, file, 0) : MAP_FAILED;
+        close(file); // The mapping stays valid
+        if (view == MAP_FAILED)
+        {
+            std::cerr << "Can't map " << file_name << std::endl;
+            return std::shared_ptr<const unsigned char>();
+        }
+        const size_t mapped_size = static_cast<size_t>(file_status.st_size);
+        size = mapped_size;
+        return std::shared_ptr<const unsigned char>(static_cast<const unsigned char*>(view), [mapped_size](const unsigned char* data)
+        {
+            munmap(const_cast<unsigned char*>(data), mapped_size);
+        });
+#endif
+    }
+
+    // Texture formats store their headers in little endian
+    inline uint32_t readUint32(const unsigned char* data)
+    {
+        return static_cast<uint32_t>(data[0]) | (static_cast<uint32_t>(data[1]) << 8) | (static_cast<uint32_t>(data[2]) << 16) | (static_cast<uint32_t>(data[3]) << 24);
+    }
+
+    // Larger textures are rejected, so mip sizes can not overflow and texel coordinates fit into int
+    const uint32_t max_texture_size = 1u << 16;
+
+    inline bool isValidTextureSize(uint32_t width, uint32_t height)
+    {
+        return width && height && width <= max_texture_size && height <= max_texture_size;
+    }
+
+    // Bytes of a mip of 4 byte texels, width and height must pass isValidTextureSize()
+    inline uint64_t getMipSize(uint32_t width, uint32_t height, uint32_t level)
+    {
+        return static_cast<uint64_t>(std::max(1u, width >> level)) * std::max(1u, height >> level) * 4;
+    }
+
+    // Checks that the mips fit into the file and make a valid chain before the texture points at them
+    inline bool createMappedTexture(Texture& texture, const std::shared_ptr<const unsigned char>& file, size_t file_size, TextureFormat format,
+        unsigned width, unsigned height, const std::vector<size_t>& mip_offsets)
+    {
+        size_t full_chain = 1;
+        for (unsigned size = std::max(width, height); size > 1; size >>= 1)
+        {
+            ++full_chain;
+        }
+        if (!isValidTextureSize(width, height) || mip_offsets.empty() || mip_offsets.size() > full_chain)
+        {
+            std::cerr << "Texture has invalid size or mip count" << std::endl;
+            return false;
+        }
+        for (size_t level = 0; level < mip_offsets.size(); ++level)
+        {
+            const uint64_t mip_size = getMipSize(width, height, static_cast<uint32_t>(level));
+            if (mip_offsets[level] > file_size || file_size - mip_offsets[level] < mip_size)
+            {
+                std::cerr << "Texture file is truncated" << std::endl;
+                return false;
+            }
+        }
+        texture.createFromMemory(file, format, width, height, mip_offsets);
+        return true;
+    }
+
+    // KTX 1.1 with GL_UNSIGNED_BYTE GL_RGBA or GL_BGRA texels, one face, no array layers.
+    // A file without mips (numberOfMipmapLevels is 0) loads as a single mip.
+    inline bool loadKTX(Texture& texture, const std::shared_ptr<const unsigned char>& file, size_t file_size)
+    {
+        static const unsigned char identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+        const size_t header_size = 64;
+        const unsigned char* data = file.get();
+        if (file_size < header_size || std::memcmp(data, identifier, sizeof(identifier)) != 0)
+        {
+            std::cerr << "Not a KTX 1.1 file" << std::endl;
+            return false;
+        }
+        const uint32_t endianness = readUint32(data + 12);
+        const uint32_t gl_type = readUint32(data + 16);
+        const uint32_t gl_format = readUint32(data + 24);
+        const uint32_t width = readUint32(data + 36);
+        const uint32_t height = readUint32(data + 40);
+        const uint32_t depth = readUint32(data + 44);
+        const uint32_t array_elements = readUint32(data + 48);
+        const uint32_t faces = readUint32(data + 52);
+        const uint32_t mip_count = std::max(1u, readUint32(data + 56));
+        const uint32_t key_value_size = readUint32(data + 60);
+
+        const uint32_t gl_unsigned_byte = 0x1401;
+        const uint32_t gl_rgba = 0x1908;
+        const uint32_t gl_bgra = 0x80E1;
+        if (endianness != 0x04030201 || gl_type != gl_unsigned_byte || (gl_format != gl_rgba && gl_format != gl_bgra) ||
+            depth > 1 || array_elements > 0 || faces != 1)
+        {
+            std::cerr << "KTX: only 2D textures with 8-bit RGBA or BGRA texels are supported" << std::endl;
+            return false;
+        }
+        if (!isValidTextureSize(width, height))
+        {
+            std::cerr << "Texture has invalid size or mip count" << std::endl;
+            return false;
+        }
+        if (key_value_size > file_size - header_size)
+        {
+            std::cerr << "Texture file is truncated" << std::endl;
+            return false;
+        }
+
+        // Every mip is preceded by its size, rows of 4 byte texels need no padding
+        std::vector<size_t> mip_offsets;
+        size_t offset = header_size + key_value_size;
+        for (uint32_t level = 0; level < mip_count && level < 32; ++level)
+        {
+            if (file_size - offset < 4)
+            {
+                std::cerr << "Texture file is truncated" << std::endl;
+                return false;
+            }
+            const uint32_t image_size = readUint32(data + offset);
+            if (image_size != getMipSize(width, height, level))
+            {
+                std::cerr << "KTX: mip " << level << " has unexpected size" << std::endl;
+                return false;
+            }
+            if (file_size - offset - 4 < image_size)
+            {
+                std::cerr << "Texture file is truncated" << std::endl;
+                return false;
+            }
+            mip_offsets.push_back(offset + 4);
+            offset += 4 + static_cast<size_t>(image_size);
+        }
+        return createMappedTexture(texture, file, file_size, gl_format == gl_bgra ? TextureFormat::BGRA8 : TextureFormat::RGBA8,
+            width, height, mip_offsets);
+    }
+
+    // DDS with 32-bit RGBA or BGRA texels, given by the legacy pixel format masks or by a DX10 header with
+    // DXGI_FORMAT_R8G8B8A8_UNORM or DXGI_FORMAT_B8G8R8A8_UNORM. Cube maps, volumes and arrays are not supported.
+    inline bool loadDDS(Texture& texture, const std::shared_ptr<const unsigned char>& file, size_t file_size)
+    {
+        const size_t header_size = 4 + 124;
+        const unsigned char* data = file.get();
+        if (file_size < header_size || std::memcmp(data, "DDS ", 4) != 0 || readUint32(data + 4) != 124)
+        {
+            std::cerr << "Not a DDS file" << std::endl;
+            return false;
+        }
+        const uint32_t flags = readUint32(data + 8);
+        const uint32_t height = readUint32(data + 12);
+        const uint32_t width = readUint32(data + 16);
+        const uint32_t mip_count = (flags & 0x20000) ? std::max(1u, readUint32(data + 28)) : 1; // DDSD_MIPMAPCOUNT
+        const uint32_t pixel_flags = readUint32(data + 80);
+        const uint32_t four_cc = readUint32(data + 84);
+        const uint32_t bit_count = readUint32(data + 88);
+        const uint32_t red_mask = readUint32(data + 92);
+        const uint32_t green_mask = readUint32(data + 96);
+        const uint32_t blue_mask = readUint32(data + 100);
+        const uint32_t alpha_mask = readUint32(data + 104);
+        const uint32_t caps2 = readUint32(data + 112);
+
+        const uint32_t ddpf_alphapixels = 0x1;
+        const uint32_t ddpf_fourcc = 0x4;
+        const uint32_t ddpf_rgb = 0x40;
+        const uint32_t dx10 = 0x30315844; // "DX10"
+        size_t offset = header_size;
+        bool supported = false;
+        TextureFormat format = TextureFormat::RGBA8;
+        if ((pixel_flags & ddpf_fourcc) && four_cc == dx10)
+        {
+            if (file_size < header_size + 20)
+            {
+                std::cerr << "Texture file is truncated" << std::endl;
+                return false;
+            }
+            const uint32_t dxgi_format = readUint32(data + offset);
+            const uint32_t dimension = readUint32(data + offset + 4);
+            const uint32_t misc_flags = readUint32(data + offset + 8);
+            const uint32_t array_size = readUint32(data + offset + 12);
+            const uint32_t dxgi_r8g8b8a8_unorm = 28;
+            const uint32_t dxgi_b8g8r8a8_unorm = 87;
+            const uint32_t texture2d = 3;
+            supported = (dxgi_format == dxgi_r8g8b8a8_unorm || dxgi_format == dxgi_b8g8r8a8_unorm) &&
+                dimension == texture2d && !(misc_flags & 0x4) && array_size <= 1;
+            format = dxgi_format == dxgi_b8g8r8a8_unorm ? TextureFormat::BGRA8 : TextureFormat::RGBA8;
+            offset += 20;
+        }
+        else if ((pixel_flags & ddpf_rgb) && (pixel_flags & ddpf_alphapixels) && bit_count == 32 &&
+            green_mask == 0x0000FF00 && alpha_mask == 0xFF000000)
+        {
+            supported = (red_mask == 0x000000FF && blue_mask == 0x00FF0000) || (red_mask == 0x00FF0000 && blue_mask == 0x000000FF);
+            format = red_mask == 0x00FF0000 ? TextureFormat::BGRA8 : TextureFormat::RGBA8;
+        }
+        if (!supported || (caps2 & 0x200) || (caps2 & 0x200000)) // DDSCAPS2_CUBEMAP, DDSCAPS2_VOLUME
+        {
+            std::cerr << "DDS: only 2D textures with 8-bit RGBA or BGRA texels are supported" << std::endl;
+            return false;
+        }
+
+        if (!isValidTextureSize(width, height))
+        {
+            std::cerr << "Texture has invalid size or mip count" << std::endl;
+            return false;
+        }
+
+        // Mips follow each other without padding
+        std::vector<size_t> mip_offsets;
+        for (uint32_t level = 0; level < mip_count && level < 32; ++level)
+        {
+            const uint64_t mip_size = getMipSize(width, height, level);
+            if (file_size - offset < mip_size)
+            {
+                std::cerr << "Texture file is truncated" << std::endl;
+                return false;
+            }
+            mip_offsets.push_back(offset);
+            offset += static_cast<size_t>(mip_size);
+        }
+        return createMappedTexture(texture, file, file_size, format, width, height, mip_offsets);
+    }
+
+    // Maps a KTX or DDS file, recognized by its contents, as the texels of the texture.
+    // The texture keeps the file mapped, on failure the texture is left unchanged.
+    inline bool loadTexture(Texture& texture, const std::string& file_name)
+    {
+        size_t file_size = 0;
+        const std::shared_ptr<const unsigned char> file = mapFile(file_name, file_size);
+        if (!file)
+        {
+            return false;
+        }
+        const bool loaded = file_size >= 4 && std::memcmp(file.get(), "DDS ", 4) == 0 ?
+            loadDDS(texture, file, file_size) : loadKTX(texture, file, file_size);
+        if (!loaded)
+        {
+            std::cerr << "Can't load " << file_name << std::endl;
+        }
+        return loaded;
+    }
+}
@@ -0,0 +1,176 @@
+// Copyright (c) 2019 Petr Petrov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace BGFXShaderCPUEmulator
+{
+    // Fixed set of worker threads, each with its own job queue.
+    // A worker takes jobs from the front of its own queue and steals from the back of the other queues when idle.
+    class ThreadPool
+    {
+    public:
+        // job(job_index, worker_index)
+        typedef std::function<void(size_t, size_t)> Job;
+
+    private:
+        struct WorkQueue
+        {
+            std::mutex mutex;
+            std::deque<std::pair<const Job*, size_t>> jobs;
+        };
+
+        std::vector<std::thread> threads;
+        std::vector<std::unique_ptr<WorkQueue>> queues;
+        std::atomic<size_t> pending;
+        std::mutex mutex;
+        std::condition_variable wake_up;
+        std::condition_variable done;
+        size_t generation;
+        bool stopping;
+
+        bool popJob(size_t worker_index, std::pair<const Job*, size_t>& job)
+        {
+            for (size_t i = 0; i < queues.size(); ++i)
+            {
+                const size_t queue_index = (worker_index + i) % queues.size();
+                WorkQueue& queue = *queues[queue_index];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (queue.jobs.empty())
+                {
+                    continue;
+                }
+                if (queue_index == worker_index)
+                {
+                    job = queue.jobs.front();
+                    queue.jobs.pop_front();
+                }
+                else
+                {
+                    job = queue.jobs.back();
+                    queue.jobs.pop_back();
+                }
+                return true;
+            }
+            return false;
+        }
+
+        void workerMain(size_t worker_index)
+        {
+            size_t seen_generation = 0;
+            for (;;)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    wake_up.wait(lock, [&] { return stopping || generation != seen_generation; });
+                    if (stopping)
+                    {
+                        return;
+                    }
+                    seen_generation = generation;
+                }
+
+                std::pair<const Job*, size_t> job;
+                while (popJob(worker_index, job))
+                {
+                    (*job.first)(job.second, worker_index);
+                    if (--pending == 0)
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        done.notify_all();
+                    }
+                }
+            }
+        }
+
+    public:
+        ThreadPool(size_t thread_count) : pending(0), generation(0), stopping(false)
+        {
+            if (thread_count == 0)
+            {
+                thread_count = 1;
+            }
+            for (size_t i = 0; i < thread_count; ++i)
+            {
+                queues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue));
+            }
+            for (size_t i = 0; i < thread_count; ++i)
+            {
+                threads.push_back(std::thread(&ThreadPool::workerMain, this, i));
+            }
+        }
+
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake_up.notify_all();
+            for (size_t i = 0; i < threads.size(); ++i)
+            {
+                threads[i].join();
+            }
+        }
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        size_t getThreadCount() const
+        {
+            return threads.size();
+        }
+
+        // Runs job for every index in [0, job_count) and blocks until all of them are finished.
+        // Jobs are dealt to the worker queues round-robin, so the initial distribution is deterministic.
+        void run(size_t job_count, const Job& job)
+        {
+            if (job_count == 0)
+            {
+                return;
+            }
+            pending = job_count;
+            for (size_t i = 0; i < job_count; ++i)
+            {
+                WorkQueue& queue = *queues[i % queues.size()];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                queue.jobs.push_back(std::make_pair(&job, i));
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ++generation;
+            }
+            wake_up.notify_all();
+
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [&] { return pending == 0; });
+        }
+    };
+}
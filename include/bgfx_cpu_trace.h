@@ -0,0 +1,192 @@
+// Copyright (c) 2019 Petr Petrov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Render timelines are recorded only when BGFX_SHADER_TRACE is defined, otherwise BGFX_SHADER_TRACE_SCOPE expands to
+// nothing and CPURendering has no tracing members
+#if defined(BGFX_SHADER_TRACE)
+#define BGFX_SHADER_TRACE_CONCAT_(a, b) a##b
+#define BGFX_SHADER_TRACE_CONCAT(a, b) BGFX_SHADER_TRACE_CONCAT_(a, b)
+// Records the enclosing scope as an event of the buffer, a null buffer records nothing
+#define BGFX_SHADER_TRACE_SCOPE(buffer, name, index) \
+    ::BGFXShaderCPUEmulator::TraceScope BGFX_SHADER_TRACE_CONCAT(trace_scope_, __LINE__)(buffer, name, index)
+#else
+#define BGFX_SHADER_TRACE_SCOPE(buffer, name, index)
+#endif
+
+namespace BGFXShaderCPUEmulator
+{
+    struct TraceEvent
+    {
+        const char* name; // String literal
+        int64_t index;    // Draw, tile or job index, negative for none
+        uint64_t begin;   // Nanoseconds since the start of the trace
+        uint64_t duration;
+    };
+
+    // Ring of the latest events of one thread. Only that thread writes it, so recording takes no lock and no atomic,
+    // the events are read after the thread pool or the frame future has handed them over.
+    class TraceBuffer
+    {
+        std::vector<TraceEvent> events;
+        size_t written; // Events recorded so far, the oldest ones are overwritten when more than events.size()
+        uint64_t start_time;
+
+    public:
+        TraceBuffer(size_t capacity, uint64_t start_time_) : events(capacity), written(0), start_time(start_time_)
+        {
+        }
+
+        static uint64_t getTime()
+        {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+        }
+
+        void record(const char* name, int64_t index, uint64_t begin, uint64_t end)
+        {
+            TraceEvent& event = events[written++ % events.size()];
+            event.name = name;
+            event.index = index;
+            event.begin = begin - start_time;
+            event.duration = end - begin;
+        }
+
+        // Recorded events, oldest first
+        template <typename Function>
+        void forEachEvent(Function function) const
+        {
+            const size_t count = std::min(written, events.size());
+            for (size_t i = written - count; i < written; ++i)
+            {
+                function(events[i % events.size()]);
+            }
+        }
+    };
+
+    class TraceScope
+    {
+        TraceBuffer* buffer;
+        const char* name;
+        int64_t index;
+        uint64_t begin;
+
+    public:
+        TraceScope(TraceBuffer* buffer_, const char* name_, int64_t index_ = -1) : buffer(buffer_), name(name_), index(index_)
+        {
+            begin = buffer ? TraceBuffer::getTime() : 0;
+        }
+
+        ~TraceScope()
+        {
+            if (buffer)
+            {
+                buffer->record(name, index, begin, TraceBuffer::getTime());
+            }
+        }
+
+        TraceScope(const TraceScope&) = delete;
+        TraceScope& operator=(const TraceScope&) = delete;
+    };
+
+    // Trace of a renderer: buffer 0 belongs to the thread calling render() or frame(), buffer 1 + i to worker i
+    // of the thread pool. Saved as Chrome trace event JSON, opened by chrome://tracing and ui.perfetto.dev.
+    class Trace
+    {
+        std::vector<std::unique_ptr<TraceBuffer>> buffers;
+        size_t events_per_thread;
+        uint64_t start_time;
+
+    public:
+        Trace(size_t events_per_thread_) : events_per_thread(events_per_thread_), start_time(TraceBuffer::getTime())
+        {
+        }
+
+        size_t getEventsPerThread() const
+        {
+            return events_per_thread;
+        }
+
+        // Adds the buffers of threads [0, thread_count), must not be called while any thread records
+        void addThreads(size_t thread_count)
+        {
+            while (buffers.size() < thread_count)
+            {
+                buffers.push_back(std::unique_ptr<TraceBuffer>(new TraceBuffer(events_per_thread, start_time)));
+            }
+        }
+
+        TraceBuffer* getBuffer(size_t thread_index) const
+        {
+            return buffers[thread_index].get();
+        }
+
+        // Complete events ("ph": "X") with microsecond timestamps, the index is stored in the arguments
+        void save(const std::string& file_name) const
+        {
+            std::ofstream out_file(file_name, std::ios::binary);
+            if (!out_file)
+            {
+                std::cerr << "Can't open " << file_name << std::endl;
+                return;
+            }
+            out_file << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+            char line[256];
+            bool first = true;
+            for (size_t thread = 0; thread < buffers.size(); ++thread)
+            {
+                if (thread == 0)
+                {
+                    std::snprintf(line, sizeof(line), "render");
+                }
+                else
+                {
+                    std::snprintf(line, sizeof(line), "worker %zu", thread - 1);
+                }
+                out_file << (first ? "\n" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << thread <<
+                    ",\"args\":{\"name\":\"" << line << "\"}}";
+                first = false;
+                buffers[thread]->forEachEvent([&](const TraceEvent& event)
+                {
+                    std::snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"cat\":\"bgfx_cpu\",\"ph\":\"X\",\"pid\":0,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f",
+                        event.name, thread, event.begin / 1000.0, event.duration / 1000.0);
+                    out_file << line;
+                    if (event.index >= 0)
+                    {
+                        out_file << ",\"args\":{\"index\":" << event.index << "}";
+                    }
+                    out_file << "}";
+                });
+            }
+            out_file << "\n]}\n";
+        }
+    };
+}
@@ -21,9 +21,21 @@
 #pragma once
 
 #include <cmath>
+#include <cstdlib>
 #include <iostream>
 #include <sstream>
 
+// vec4 and mat4 operations use SSE2 (AVX for the matrix product) when the compiler targets it.
+// Define BGFX_SHADER_NO_SIMD to use the scalar implementation only, results are the same.
+#if !defined(BGFX_SHADER_NO_SIMD) && defined(__AVX__)
+#define BGFX_SHADER_SIMD_AVX
+#define BGFX_SHADER_SIMD_SSE
+#include <immintrin.h>
+#elif !defined(BGFX_SHADER_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define BGFX_SHADER_SIMD_SSE
+#include <emmintrin.h>
+#endif
+
 // http://www.opengl.org/registry/doc/GLSLangSpec.Full.1.20.8.pdf (pages 49-50)
 const int gl_MaxLights = 8;                    // GL 1.0
 const int gl_MaxClipPlanes = 6;                // GL 1.0
@@ -207,7 +219,7 @@ struct vec3
     inline vec3(const vec4&);
 };
 
-struct vec4
+struct alignas(16) vec4
 {
     union
     {
@@ -310,6 +322,20 @@ struct vec4
     }
 };
 
+#if defined(BGFX_SHADER_SIMD_SSE)
+inline __m128 simd_load(const vec4& v)
+{
+    return _mm_load_ps(&v.x);
+}
+
+inline vec4 simd_store(__m128 m)
+{
+    vec4 v;
+    _mm_store_ps(&v.x, m);
+    return v;
+}
+#endif
+
 #define op_vec2(OPN,OP) \
     inline vec2 OPN(const vec2 v1, const vec2 v2) { \
         return vec2(v1.x OP v2.x, v1.y OP v2.y); \
@@ -318,7 +344,7 @@ struct vec4
         return vec2(v.x OP f, v.y OP f); \
     } \
     inline vec2 OPN(float f, const vec2 v) { \
-        return vec2(v.x OP f, v.y OP f); \
+        return vec2(f OP v.x, f OP v.y); \
     }
 
 #define op_vec2_self_assignment(OPN,OP) \
@@ -339,7 +365,7 @@ struct vec4
         return vec3(v.x OP f, v.y OP f, v.z OP f); \
     } \
     inline vec3 OPN(float f, const vec3 v) { \
-        return vec3(v.x OP f, v.y OP f, v.z OP f); \
+        return vec3(f OP v.x, f OP v.y, f OP v.z); \
     }
 
 #define op_vec3_self_assignment(OPN,OP) \
@@ -352,7 +378,19 @@ struct vec4
         return v; \
     }
 
-#define op_vec4(OPN,OP) \
+#if defined(BGFX_SHADER_SIMD_SSE)
+#define op_vec4(OPN,OP,SIMD_OP) \
+    inline vec4 OPN(const vec4 v1, const vec4 v2) { \
+        return simd_store(SIMD_OP(simd_load(v1), simd_load(v2))); \
+    } \
+    inline vec4 OPN(const vec4 v, float f) { \
+        return simd_store(SIMD_OP(simd_load(v), _mm_set1_ps(f))); \
+    } \
+    inline vec4 OPN(float f, const vec4 v) { \
+        return simd_store(SIMD_OP(_mm_set1_ps(f), simd_load(v))); \
+    }
+#else
+#define op_vec4(OPN,OP,SIMD_OP) \
     inline vec4 OPN(const vec4 v1, const vec4 v2) { \
         return vec4(v1.x OP v2.x, v1.y OP v2.y, v1.z OP v2.z, v1.w OP v2.w); \
     } \
@@ -360,8 +398,9 @@ struct vec4
         return vec4(v.x OP f, v.y OP f, v.z OP f, v.w OP f); \
     } \
     inline vec4 OPN(float f, const vec4 v) { \
-        return vec4(v.x OP f, v.y OP f, v.z OP f, v.w OP f); \
+        return vec4(f OP v.x, f OP v.y, f OP v.z, f OP v.w); \
     }
+#endif
 
 #define op_vec4_self_assignment(OPN,OP) \
     inline vec4& OPN(vec4& v1, const vec4 v2) { \
@@ -373,20 +412,20 @@ struct vec4
         return v; \
     }
 
-#define op_vec(OPN,OP) \
+#define op_vec(OPN,OP,SIMD_OP) \
     op_vec2(OPN,OP) \
     op_vec3(OPN,OP) \
-    op_vec4(OPN,OP)
+    op_vec4(OPN,OP,SIMD_OP)
 
 #define op_vec_self_assignment(OPN,OP) \
     op_vec2_self_assignment(OPN,OP) \
     op_vec3_self_assignment(OPN,OP) \
     op_vec4_self_assignment(OPN,OP)
 
-op_vec(operator+, +);
-op_vec(operator-, -);
-op_vec(operator*, *);
-op_vec(operator/, /);
+op_vec(operator+, +, _mm_add_ps);
+op_vec(operator-, -, _mm_sub_ps);
+op_vec(operator*, *, _mm_mul_ps);
+op_vec(operator/, /, _mm_div_ps);
 op_vec_self_assignment(operator+=, +);
 op_vec_self_assignment(operator-=, -);
 
@@ -574,30 +613,91 @@ struct mat4
         return z;
     }
 
+    // Column c of the product is m[c].x * cols[0] + m[c].y * cols[1] + m[c].z * cols[2] + m[c].w * cols[3],
+    // summed in this order by every implementation.
     mat4 operator*(const mat4& m)
     {
         mat4 z;
+#if defined(BGFX_SHADER_SIMD_AVX)
+        for (int c = 0; c < 4; c += 2)
+        {
+            const __m256 columns = _mm256_loadu_ps(&m.cols[c].x);
+            __m256 result = _mm256_mul_ps(_mm256_shuffle_ps(columns, columns, _MM_SHUFFLE(0, 0, 0, 0)), _mm256_broadcast_ps(reinterpret_cast<const __m128*>(&cols[0].x)));
+            result = _mm256_add_ps(result, _mm256_mul_ps(_mm256_shuffle_ps(columns, columns, _MM_SHUFFLE(1, 1, 1, 1)), _mm256_broadcast_ps(reinterpret_cast<const __m128*>(&cols[1].x))));
+            result = _mm256_add_ps(result, _mm256_mul_ps(_mm256_shuffle_ps(columns, columns, _MM_SHUFFLE(2, 2, 2, 2)), _mm256_broadcast_ps(reinterpret_cast<const __m128*>(&cols[2].x))));
+            result = _mm256_add_ps(result, _mm256_mul_ps(_mm256_shuffle_ps(columns, columns, _MM_SHUFFLE(3, 3, 3, 3)), _mm256_broadcast_ps(reinterpret_cast<const __m128*>(&cols[3].x))));
+            _mm256_storeu_ps(&z.cols[c].x, result);
+        }
+#elif defined(BGFX_SHADER_SIMD_SSE)
         for (int c = 0; c < 4; c++)
         {
-            vec4 col;
-            for (int r = 0; r < 4; r++)
-            {
-                col[r] = dot(m[c], vec4(row(r)));
-            }
-            z[c] = col;
+            const __m128 column = simd_load(m.cols[c]);
+            __m128 result = _mm_mul_ps(_mm_shuffle_ps(column, column, _MM_SHUFFLE(0, 0, 0, 0)), simd_load(cols[0]));
+            result = _mm_add_ps(result, _mm_mul_ps(_mm_shuffle_ps(column, column, _MM_SHUFFLE(1, 1, 1, 1)), simd_load(cols[1])));
+            result = _mm_add_ps(result, _mm_mul_ps(_mm_shuffle_ps(column, column, _MM_SHUFFLE(2, 2, 2, 2)), simd_load(cols[2])));
+            result = _mm_add_ps(result, _mm_mul_ps(_mm_shuffle_ps(column, column, _MM_SHUFFLE(3, 3, 3, 3)), simd_load(cols[3])));
+            z.cols[c] = simd_store(result);
+        }
+#else
+        for (int c = 0; c < 4; c++)
+        {
+            z[c] = m[c].x * cols[0];
+            z[c] += m[c].y * cols[1];
+            z[c] += m[c].z * cols[2];
+            z[c] += m[c].w * cols[3];
         }
+#endif
         return z;
     }
 };
 
+// Component c of the result is dot(v, m[c])
 inline vec4 mul(const mat4& m, const vec4& v)
 {
+#if defined(BGFX_SHADER_SIMD_SSE)
+    __m128 c0 = simd_load(m.cols[0]);
+    __m128 c1 = simd_load(m.cols[1]);
+    __m128 c2 = simd_load(m.cols[2]);
+    __m128 c3 = simd_load(m.cols[3]);
+    _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+    __m128 result = _mm_mul_ps(_mm_set1_ps(v.x), c0);
+    result = _mm_add_ps(result, _mm_mul_ps(_mm_set1_ps(v.y), c1));
+    result = _mm_add_ps(result, _mm_mul_ps(_mm_set1_ps(v.z), c2));
+    result = _mm_add_ps(result, _mm_mul_ps(_mm_set1_ps(v.w), c3));
+    return simd_store(result);
+#else
     vec4 z;
     for (int c = 0; c < 4; c++)
     {
         z[c] = dot(v, m[c]);
     }
     return z;
+#endif
+}
+
+// Matrices of bgfx shaders, mul(mtxFromCols(c0, c1, c2, c3), v) is c0 * v.x + c1 * v.y + c2 * v.z + c3 * v.w
+inline mat4 mtxFromCols(const vec4& c0, const vec4& c1, const vec4& c2, const vec4& c3)
+{
+    return mat4(vec4(c0.x, c1.x, c2.x, c3.x), vec4(c0.y, c1.y, c2.y, c3.y), vec4(c0.z, c1.z, c2.z, c3.z), vec4(c0.w, c1.w, c2.w, c3.w));
+}
+
+// mul(mtxFromRows(r0, r1, r2, r3), v) is vec4(dot(r0, v), dot(r1, v), dot(r2, v), dot(r3, v))
+inline mat4 mtxFromRows(const vec4& r0, const vec4& r1, const vec4& r2, const vec4& r3)
+{
+    return mat4(r0, r1, r2, r3);
+}
+
+// Transform by a matrix built from instance data as bgfx instancing shaders do, model[0] = i_data0 ... model[3] = i_data3:
+// like mtx * vec of GLSL, m[i] is column i
+inline vec4 instMul(const mat4& m, const vec4& v)
+{
+    return m[0] * v.x + m[1] * v.y + m[2] * v.z + m[3] * v.w;
+}
+
+// Like vec * mtx of GLSL, component c of the result is dot(v, m[c])
+inline vec4 instMul(const vec4& v, const mat4& m)
+{
+    return mul(m, v);
 }
 
 // component-wise operations on one vector
@@ -627,13 +727,13 @@ inline vec4 mul(const mat4& m, const vec4& v)
 // component-wise operations on one float and one vector
 #define app_fv(f) \
     inline vec2 f(float x, vec2 v) { \
-        return vec2(f(v.x,x),f(v.y,x)); \
+        return vec2(f(x,v.x),f(x,v.y)); \
     } \
     inline vec3 f(float x, vec3 v) { \
-        return vec3(f(v.x,x),f(v.y,x),f(v.z,x)); \
+        return vec3(f(x,v.x),f(x,v.y),f(x,v.z)); \
     } \
     inline vec4 f(float x, vec4 v) { \
-        return vec4(f(v.x,x),f(v.y,x),f(v.z,x),f(v.w,x)); \
+        return vec4(f(x,v.x),f(x,v.y),f(x,v.z),f(x,v.w)); \
     }
 
 // component-wise operations on one vector and two floats
@@ -651,13 +751,13 @@ inline vec4 mul(const mat4& m, const vec4& v)
 // component-wise operations on two floats and one vector
 #define app_f2v(f) \
     inline vec2 f(float x, float y, vec2 v) { \
-        return vec2(f(v.x,x,y),f(v.y,x,y)); \
+        return vec2(f(x,y,v.x),f(x,y,v.y)); \
     } \
     inline vec3 f(float x, float y, vec3 v) { \
-        return vec3(f(v.x,x,y),f(v.y,x,y),f(v.z,x,y)); \
+        return vec3(f(x,y,v.x),f(x,y,v.y),f(x,y,v.z)); \
     } \
     inline vec4 f(float x, float y, vec4 v) { \
-        return vec4(f(v.x,x,y),f(v.y,x,y),f(v.z,x,y),f(v.w,x,y)); \
+        return vec4(f(x,y,v.x),f(x,y,v.y),f(x,y,v.z),f(x,y,v.w)); \
     }
 
 // component-wise operations on two vectors
@@ -804,10 +904,7 @@ app_v(inversesqrt)
 
 // common functions
 #ifndef _WIN32
-inline float abs(float x)
-{
-    return fabs(x);
-}
+using std::abs; // The same overload set as <stdlib.h> gives, so the two can be included in any order
 #endif
 app_v(abs)
 
@@ -911,17 +1008,3 @@ defT_v2f(refract, I, N, eta,
 #undef defT_v2
 #undef defT_v2f
 #undef defT_v3
-
-extern vec4 gl_Position;
-extern vec4 gl_FragColor;
-
-extern mat4 u_view;
-extern mat4 u_invView;
-extern mat4 u_proj;
-extern mat4 u_invProj;
-extern mat4 u_viewProj;
-extern mat4 u_invViewProj;
-extern mat4 u_modelView;
-extern mat4 u_modelViewProj;
-
-#include "varying.def.sc"
@@ -21,3 +21,4 @@
 #pragma once
 
 #include "bgfx_shader.h"
+#include "bgfx_shader_texture.h"
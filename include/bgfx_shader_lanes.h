@@ -0,0 +1,944 @@
+// Copyright (c) 2019 Petr Petrov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+// Shader types whose every component holds lane_count values, one per pixel.
+// A fragment shader compiled with these types (see bgfx_shader_lanes_begin.sh) shades lane_count pixels per call.
+// Every lane computes exactly the same float operations as the scalar types in bgfx_shader.h.
+//
+// Uses the SIMD backend selected in bgfx_shader.h, define BGFX_SHADER_NO_SIMD to force the portable implementation.
+
+#include <cstdint>
+#include "bgfx_shader.h"
+#include "bgfx_shader_texture.h"
+
+namespace BGFXShaderLanes
+{
+    const int lane_count = 8;
+    // Lanes are lane_width pixels wide rows of a block, lane l is at (l % lane_width, l / lane_width)
+    const int lane_width = 4;
+
+    // Per lane condition, every lane is 0 or ~0u
+    struct vbool
+    {
+        uint32_t lane[lane_count];
+
+        vbool() = default;
+
+        vbool(bool b)
+        {
+            for (int i = 0; i < lane_count; ++i)
+            {
+                lane[i] = b ? ~0u : 0u;
+            }
+        }
+
+        bool operator[](int i) const
+        {
+            return lane[i] != 0;
+        }
+    };
+
+    struct vfloat
+    {
+        float lane[lane_count];
+
+        vfloat() = default;
+
+        vfloat(float f)
+        {
+            for (int i = 0; i < lane_count; ++i)
+            {
+                lane[i] = f;
+            }
+        }
+
+        float operator[](int i) const
+        {
+            return lane[i];
+        }
+
+        float& operator[](int i)
+        {
+            return lane[i];
+        }
+    };
+
+#if defined(BGFX_SHADER_SIMD_AVX)
+#define lanes_binary(result, a, b, avx_op, sse_op, scalar_expr) \
+    _mm256_storeu_ps(result.lane, avx_op(_mm256_loadu_ps(a.lane), _mm256_loadu_ps(b.lane)))
+#define lanes_compare(result, a, b, avx_predicate, sse_op, op) \
+    _mm256_storeu_ps(reinterpret_cast<float*>(result.lane), _mm256_cmp_ps(_mm256_loadu_ps(a.lane), _mm256_loadu_ps(b.lane), avx_predicate))
+#elif defined(BGFX_SHADER_SIMD_SSE)
+#define lanes_binary(result, a, b, avx_op, sse_op, scalar_expr) \
+    _mm_storeu_ps(result.lane, sse_op(_mm_loadu_ps(a.lane), _mm_loadu_ps(b.lane))); \
+    _mm_storeu_ps(result.lane + 4, sse_op(_mm_loadu_ps(a.lane + 4), _mm_loadu_ps(b.lane + 4)))
+#define lanes_compare(result, a, b, avx_predicate, sse_op, op) \
+    _mm_storeu_ps(reinterpret_cast<float*>(result.lane), sse_op(_mm_loadu_ps(a.lane), _mm_loadu_ps(b.lane))); \
+    _mm_storeu_ps(reinterpret_cast<float*>(result.lane + 4), sse_op(_mm_loadu_ps(a.lane + 4), _mm_loadu_ps(b.lane + 4)))
+#else
+#define lanes_binary(result, a, b, avx_op, sse_op, scalar_expr) \
+    for (int i = 0; i < lane_count; ++i) \
+    { \
+        const float x = a.lane[i]; \
+        const float y = b.lane[i]; \
+        result.lane[i] = scalar_expr; \
+    }
+#define lanes_compare(result, a, b, avx_predicate, sse_op, op) \
+    for (int i = 0; i < lane_count; ++i) \
+    { \
+        result.lane[i] = a.lane[i] op b.lane[i] ? ~0u : 0u; \
+    }
+#endif
+
+#define op_vfloat(OPN, avx_op, sse_op, OP) \
+    inline vfloat OPN(const vfloat& a, const vfloat& b) { \
+        vfloat result; \
+        lanes_binary(result, a, b, avx_op, sse_op, x OP y); \
+        return result; \
+    }
+
+    op_vfloat(operator+, _mm256_add_ps, _mm_add_ps, +)
+    op_vfloat(operator-, _mm256_sub_ps, _mm_sub_ps, -)
+    op_vfloat(operator*, _mm256_mul_ps, _mm_mul_ps, *)
+    op_vfloat(operator/, _mm256_div_ps, _mm_div_ps, /)
+
+#undef op_vfloat
+
+#define cmp_vfloat(OPN, avx_predicate, sse_op, OP) \
+    inline vbool OPN(const vfloat& a, const vfloat& b) { \
+        vbool result; \
+        lanes_compare(result, a, b, avx_predicate, sse_op, OP); \
+        return result; \
+    }
+
+    cmp_vfloat(operator<, _CMP_LT_OQ, _mm_cmplt_ps, <)
+    cmp_vfloat(operator<=, _CMP_LE_OQ, _mm_cmple_ps, <=)
+    cmp_vfloat(operator>, _CMP_GT_OQ, _mm_cmpgt_ps, >)
+    cmp_vfloat(operator>=, _CMP_GE_OQ, _mm_cmpge_ps, >=)
+    cmp_vfloat(operator==, _CMP_EQ_OQ, _mm_cmpeq_ps, ==)
+    cmp_vfloat(operator!=, _CMP_NEQ_UQ, _mm_cmpneq_ps, !=)
+
+#undef cmp_vfloat
+
+    inline vfloat operator-(const vfloat& a)
+    {
+        return a * vfloat(-1.0f);
+    }
+
+    inline vfloat& operator+=(vfloat& a, const vfloat& b)
+    {
+        a = a + b;
+        return a;
+    }
+
+    inline vfloat& operator-=(vfloat& a, const vfloat& b)
+    {
+        a = a - b;
+        return a;
+    }
+
+    inline vbool operator&&(const vbool& a, const vbool& b)
+    {
+        vbool result;
+        for (int i = 0; i < lane_count; ++i)
+        {
+            result.lane[i] = a.lane[i] & b.lane[i];
+        }
+        return result;
+    }
+
+    inline vbool operator||(const vbool& a, const vbool& b)
+    {
+        vbool result;
+        for (int i = 0; i < lane_count; ++i)
+        {
+            result.lane[i] = a.lane[i] | b.lane[i];
+        }
+        return result;
+    }
+
+    inline vbool operator!(const vbool& a)
+    {
+        vbool result;
+        for (int i = 0; i < lane_count; ++i)
+        {
+            result.lane[i] = ~a.lane[i];
+        }
+        return result;
+    }
+
+    inline bool any(const vbool& a)
+    {
+        uint32_t result = 0;
+        for (int i = 0; i < lane_count; ++i)
+        {
+            result |= a.lane[i];
+        }
+        return result != 0;
+    }
+
+    inline bool all(const vbool& a)
+    {
+        uint32_t result = ~0u;
+        for (int i = 0; i < lane_count; ++i)
+        {
+            result &= a.lane[i];
+        }
+        return result != 0;
+    }
+
+    // Per lane condition ? a : b
+    inline vfloat select(const vbool& condition, const vfloat& a, const vfloat& b)
+    {
+        vfloat result;
+#if defined(BGFX_SHADER_SIMD_AVX)
+        const __m256 mask = _mm256_loadu_ps(reinterpret_cast<const float*>(condition.lane));
+        _mm256_storeu_ps(result.lane, _mm256_blendv_ps(_mm256_loadu_ps(b.lane), _mm256_loadu_ps(a.lane), mask));
+#else
+        for (int i = 0; i < lane_count; ++i)
+        {
+            result.lane[i] = condition.lane[i] ? a.lane[i] : b.lane[i];
+        }
+#endif
+        return result;
+    }
+
+    // Stores value only into the lanes where mask is set
+    inline void masked_assign(vfloat& target, const vbool& mask, const vfloat& value)
+    {
+        target = select(mask, value, target);
+    }
+
+    inline vfloat sqrt(const vfloat& a)
+    {
+        vfloat result;
+#if defined(BGFX_SHADER_SIMD_AVX)
+        _mm256_storeu_ps(result.lane, _mm256_sqrt_ps(_mm256_loadu_ps(a.lane)));
+#elif defined(BGFX_SHADER_SIMD_SSE)
+        _mm_storeu_ps(result.lane, _mm_sqrt_ps(_mm_loadu_ps(a.lane)));
+        _mm_storeu_ps(result.lane + 4, _mm_sqrt_ps(_mm_loadu_ps(a.lane + 4)));
+#else
+        for (int i = 0; i < lane_count; ++i)
+        {
+            result.lane[i] = ::sqrt(a.lane[i]);
+        }
+#endif
+        return result;
+    }
+
+    // Layout of vfloat without constructors, because members of the anonymous struct in vec4 cannot have them
+    struct vfloat_storage
+    {
+        float lane[lane_count];
+
+        vfloat_storage& operator=(const vfloat& f)
+        {
+            static_cast<vfloat&>(*this) = f;
+            return *this;
+        }
+
+        operator vfloat&()
+        {
+            return *reinterpret_cast<vfloat*>(lane);
+        }
+
+        operator const vfloat&() const
+        {
+            return *reinterpret_cast<const vfloat*>(lane);
+        }
+
+        float operator[](int i) const
+        {
+            return lane[i];
+        }
+
+        float& operator[](int i)
+        {
+            return lane[i];
+        }
+    };
+
+    struct vec3;
+    struct vec4;
+
+    struct vec2
+    {
+        union
+        {
+            vfloat x;
+            vfloat u;
+        };
+        union
+        {
+            vfloat y;
+            vfloat v;
+        };
+
+        vec2()
+        {
+            x = 0.0f;
+            y = 0.0f;
+        }
+
+        vec2(const vfloat& x_, const vfloat& y_)
+        {
+            x = x_; y = y_;
+        }
+
+        // Same value in all lanes
+        vec2(const ::vec2& v_)
+        {
+            x = v_.x; y = v_.y;
+        }
+
+        vfloat operator[](int i) const
+        {
+            switch (i)
+            {
+            case 0: return x;
+            case 1: return y;
+            }
+            std::cerr << "Out of bounds index " << i << " on vec2" << std::endl;
+            return (*this)[i % 2];
+        }
+
+        vfloat& operator[](int i)
+        {
+            switch (i)
+            {
+            case 0: return x;
+            case 1: return y;
+            }
+            std::cerr << "Out of bounds index " << i << " on vec2" << std::endl;
+            return (*this)[i % 2];
+        }
+
+        vec2 operator-() const
+        {
+            return vec2(-x, -y);
+        }
+
+        inline vec2(const vec3&);
+        inline vec2(const vec4&);
+    };
+
+    struct vec3
+    {
+        union
+        {
+            vfloat x;
+            vfloat r;
+        };
+        union
+        {
+            vfloat y;
+            vfloat g;
+        };
+        union
+        {
+            vfloat z;
+            vfloat b;
+        };
+
+        vec3()
+        {
+            x = 0.0f;
+            y = 0.0f;
+            z = 0.0f;
+        }
+
+        vec3(const vfloat& x_, const vfloat& y_, const vfloat& z_)
+        {
+            x = x_; y = y_; z = z_;
+        }
+
+        // Same value in all lanes
+        vec3(const ::vec3& v_)
+        {
+            x = v_.x; y = v_.y; z = v_.z;
+        }
+
+        vfloat operator[](int i) const
+        {
+            switch (i)
+            {
+            case 0: return x;
+            case 1: return y;
+            case 2: return z;
+            }
+            std::cerr << "Out of bounds index " << i << " on vec3" << std::endl;
+            return (*this)[i % 3];
+        }
+
+        vfloat& operator[](int i)
+        {
+            switch (i)
+            {
+            case 0: return x;
+            case 1: return y;
+            case 2: return z;
+            }
+            std::cerr << "Out of bounds index " << i << " on vec3" << std::endl;
+            return (*this)[i % 3];
+        }
+
+        vec3 operator-() const
+        {
+            return vec3(-x, -y, -z);
+        }
+
+        inline vec3(const vec4&);
+    };
+
+    struct vec4
+    {
+        union
+        {
+            struct
+            {
+                union
+                {
+                    vfloat_storage x;
+                    vfloat_storage r;
+                };
+                union
+                {
+                    vfloat_storage y;
+                    vfloat_storage g;
+                };
+                union
+                {
+                    vfloat_storage z;
+                    vfloat_storage b;
+                };
+            };
+            vec3 rgb;
+            vec3 xyz;
+        };
+        union
+        {
+            vfloat w;
+            vfloat a;
+        };
+
+        vec4()
+        {
+            x = 0.0f;
+            y = 0.0f;
+            z = 0.0f;
+            w = 0.0f;
+        }
+
+        vec4(const vfloat& x_, const vfloat& y_, const vfloat& z_, const vfloat& w_)
+        {
+            x = x_; y = y_; z = z_; w = w_;
+        }
+
+        vec4(const vec4& v_)
+        {
+            x = v_.x; y = v_.y; z = v_.z; w = v_.w;
+        }
+
+        vec4(const vec3& v_, const vfloat& f)
+        {
+            x = v_.x; y = v_.y; z = v_.z; w = f;
+        }
+
+        // Same value in all lanes
+        vec4(const ::vec4& v_)
+        {
+            x = v_.x; y = v_.y; z = v_.z; w = v_.w;
+        }
+
+        vec4& operator=(const vec4& v_)
+        {
+            x = v_.x; y = v_.y; z = v_.z; w = v_.w;
+            return *this;
+        }
+
+        vfloat operator[](int i) const
+        {
+            switch (i)
+            {
+            case 0: return x;
+            case 1: return y;
+            case 2: return z;
+            case 3: return w;
+            }
+            std::cerr << "Out of bounds index " << i << " on vec4" << std::endl;
+            return (*this)[i % 4];
+        }
+
+        vfloat& operator[](int i)
+        {
+            switch (i)
+            {
+            case 0: return x;
+            case 1: return y;
+            case 2: return z;
+            case 3: return w;
+            }
+            std::cerr << "Out of bounds index " << i << " on vec4" << std::endl;
+            return (*this)[i % 4];
+        }
+
+        vec4 operator-() const
+        {
+            return vec4(-x, -y, -z, -w);
+        }
+    };
+
+    inline vec2::vec2(const vec3& v_)
+    {
+        x = v_.x; y = v_.y;
+    }
+
+    inline vec2::vec2(const vec4& v_)
+    {
+        x = v_.x; y = v_.y;
+    }
+
+    inline vec3::vec3(const vec4& v_)
+    {
+        x = v_.x; y = v_.y; z = v_.z;
+    }
+
+#define op_vec2(OPN,OP) \
+    inline vec2 OPN(const vec2& v1, const vec2& v2) { \
+        return vec2(v1.x OP v2.x, v1.y OP v2.y); \
+    } \
+    inline vec2 OPN(const vec2& v, const vfloat& f) { \
+        return vec2(v.x OP f, v.y OP f); \
+    } \
+    inline vec2 OPN(const vfloat& f, const vec2& v) { \
+        return vec2(f OP v.x, f OP v.y); \
+    }
+
+#define op_vec3(OPN,OP) \
+    inline vec3 OPN(const vec3& v1, const vec3& v2) { \
+        return vec3(v1.x OP v2.x, v1.y OP v2.y, v1.z OP v2.z); \
+    } \
+    inline vec3 OPN(const vec3& v, const vfloat& f) { \
+        return vec3(v.x OP f, v.y OP f, v.z OP f); \
+    } \
+    inline vec3 OPN(const vfloat& f, const vec3& v) { \
+        return vec3(f OP v.x, f OP v.y, f OP v.z); \
+    }
+
+#define op_vec4(OPN,OP) \
+    inline vec4 OPN(const vec4& v1, const vec4& v2) { \
+        return vec4(v1.x OP v2.x, v1.y OP v2.y, v1.z OP v2.z, v1.w OP v2.w); \
+    } \
+    inline vec4 OPN(const vec4& v, const vfloat& f) { \
+        return vec4(v.x OP f, v.y OP f, v.z OP f, v.w OP f); \
+    } \
+    inline vec4 OPN(const vfloat& f, const vec4& v) { \
+        return vec4(f OP v.x, f OP v.y, f OP v.z, f OP v.w); \
+    }
+
+#define op_vec_self_assignment(T,OPN,OP) \
+    inline T& OPN(T& v1, const T& v2) { \
+        v1 = v1 OP v2; \
+        return v1; \
+    } \
+    inline T& OPN(T& v, const vfloat& f) { \
+        v = v OP f; \
+        return v; \
+    }
+
+#define op_vec(OPN,OP) \
+    op_vec2(OPN,OP) \
+    op_vec3(OPN,OP) \
+    op_vec4(OPN,OP)
+
+    op_vec(operator+, +)
+    op_vec(operator-, -)
+    op_vec(operator*, *)
+    op_vec(operator/, /)
+    op_vec_self_assignment(vec2, operator+=, +)
+    op_vec_self_assignment(vec3, operator+=, +)
+    op_vec_self_assignment(vec4, operator+=, +)
+    op_vec_self_assignment(vec2, operator-=, -)
+    op_vec_self_assignment(vec3, operator-=, -)
+    op_vec_self_assignment(vec4, operator-=, -)
+
+#undef op_vec2
+#undef op_vec3
+#undef op_vec4
+#undef op_vec
+#undef op_vec_self_assignment
+
+    inline vec2 select(const vbool& condition, const vec2& a, const vec2& b)
+    {
+        return vec2(select(condition, a.x, b.x), select(condition, a.y, b.y));
+    }
+
+    inline vec3 select(const vbool& condition, const vec3& a, const vec3& b)
+    {
+        return vec3(select(condition, a.x, b.x), select(condition, a.y, b.y), select(condition, a.z, b.z));
+    }
+
+    inline vec4 select(const vbool& condition, const vec4& a, const vec4& b)
+    {
+        return vec4(select(condition, a.x, b.x), select(condition, a.y, b.y), select(condition, a.z, b.z), select(condition, a.w, b.w));
+    }
+
+    template <typename T>
+    inline void masked_assign(T& target, const vbool& mask, const T& value)
+    {
+        target = select(mask, value, target);
+    }
+
+    inline vfloat dot(const vfloat& a, const vfloat& b)
+    {
+        return a * b;
+    }
+
+    inline vfloat dot(const vec2& a, const vec2& b)
+    {
+        return a.x * b.x + a.y * b.y;
+    }
+
+    inline vfloat dot(const vec3& a, const vec3& b)
+    {
+        return a.x * b.x + a.y * b.y + a.z * b.z;
+    }
+
+    inline vfloat dot(const vec4& a, const vec4& b)
+    {
+        return a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w;
+    }
+
+    inline vec3 cross(const vec3& a, const vec3& b)
+    {
+        return vec3(
+            a.y * b.z - a.z * b.y,
+            a.z * b.x - a.x * b.z,
+            a.x * b.y - a.y * b.x
+        );
+    }
+
+    inline vfloat length(const vec2& v)
+    {
+        return sqrt(v.x * v.x + v.y * v.y);
+    }
+
+    inline vfloat length(const vec3& v)
+    {
+        return sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
+    }
+
+    inline vfloat length(const vec4& v)
+    {
+        return sqrt(v.x * v.x + v.y * v.y + v.z * v.z + v.w * v.w);
+    }
+
+    // Uniform matrix times per lane vector
+    inline vec4 mul(const ::mat4& m, const vec4& v)
+    {
+        vec4 z;
+        for (int c = 0; c < 4; c++)
+        {
+            z[c] = dot(v, vec4(m[c]));
+        }
+        return z;
+    }
+
+// per lane scalar function from bgfx_shader.h
+#define lanes_f(f) \
+    inline vfloat f(const vfloat& a) { \
+        vfloat result; \
+        for (int i = 0; i < lane_count; ++i) \
+            result.lane[i] = ::f(a.lane[i]); \
+        return result; \
+    }
+
+#define lanes_f2(f) \
+    inline vfloat f(const vfloat& a, const vfloat& b) { \
+        vfloat result; \
+        for (int i = 0; i < lane_count; ++i) \
+            result.lane[i] = ::f(a.lane[i], b.lane[i]); \
+        return result; \
+    }
+
+#define lanes_f3(f) \
+    inline vfloat f(const vfloat& a, const vfloat& b, const vfloat& c) { \
+        vfloat result; \
+        for (int i = 0; i < lane_count; ++i) \
+            result.lane[i] = ::f(a.lane[i], b.lane[i], c.lane[i]); \
+        return result; \
+    }
+
+// component-wise operations on one vector
+#define app_v(f) \
+    inline vec2 f(const vec2& v) { \
+        return vec2(f(v.x),f(v.y)); \
+    } \
+    inline vec3 f(const vec3& v) { \
+        return vec3(f(v.x),f(v.y),f(v.z)); \
+    } \
+    inline vec4 f(const vec4& v) { \
+        return vec4(f(v.x),f(v.y),f(v.z),f(v.w)); \
+    }
+
+// component-wise operations on one vector and one float
+#define app_vf(f) \
+    inline vec2 f(const vec2& v, const vfloat& x) { \
+        return vec2(f(v.x,x),f(v.y,x)); \
+    } \
+    inline vec3 f(const vec3& v, const vfloat& x) { \
+        return vec3(f(v.x,x),f(v.y,x),f(v.z,x)); \
+    } \
+    inline vec4 f(const vec4& v, const vfloat& x) { \
+        return vec4(f(v.x,x),f(v.y,x),f(v.z,x),f(v.w,x)); \
+    }
+
+// component-wise operations on one float and one vector
+#define app_fv(f) \
+    inline vec2 f(const vfloat& x, const vec2& v) { \
+        return vec2(f(x,v.x),f(x,v.y)); \
+    } \
+    inline vec3 f(const vfloat& x, const vec3& v) { \
+        return vec3(f(x,v.x),f(x,v.y),f(x,v.z)); \
+    } \
+    inline vec4 f(const vfloat& x, const vec4& v) { \
+        return vec4(f(x,v.x),f(x,v.y),f(x,v.z),f(x,v.w)); \
+    }
+
+// component-wise operations on one vector and two floats
+#define app_vf2(f) \
+    inline vec2 f(const vec2& v, const vfloat& x, const vfloat& y) { \
+        return vec2(f(v.x,x,y),f(v.y,x,y)); \
+    } \
+    inline vec3 f(const vec3& v, const vfloat& x, const vfloat& y) { \
+        return vec3(f(v.x,x,y),f(v.y,x,y),f(v.z,x,y)); \
+    } \
+    inline vec4 f(const vec4& v, const vfloat& x, const vfloat& y) { \
+        return vec4(f(v.x,x,y),f(v.y,x,y),f(v.z,x,y),f(v.w,x,y)); \
+    }
+
+// component-wise operations on two floats and one vector
+#define app_f2v(f) \
+    inline vec2 f(const vfloat& x, const vfloat& y, const vec2& v) { \
+        return vec2(f(x,y,v.x),f(x,y,v.y)); \
+    } \
+    inline vec3 f(const vfloat& x, const vfloat& y, const vec3& v) { \
+        return vec3(f(x,y,v.x),f(x,y,v.y),f(x,y,v.z)); \
+    } \
+    inline vec4 f(const vfloat& x, const vfloat& y, const vec4& v) { \
+        return vec4(f(x,y,v.x),f(x,y,v.y),f(x,y,v.z),f(x,y,v.w)); \
+    }
+
+// component-wise operations on two vectors
+#define app_v2(f) \
+    inline vec2 f(const vec2& a, const vec2& b) { \
+        return vec2(f(a.x,b.x),f(a.y,b.y)); \
+    } \
+    inline vec3 f(const vec3& a, const vec3& b) { \
+        return vec3(f(a.x,b.x),f(a.y,b.y),f(a.z,b.z)); \
+    } \
+    inline vec4 f(const vec4& a, const vec4& b) { \
+        return vec4(f(a.x,b.x),f(a.y,b.y),f(a.z,b.z),f(a.w,b.w)); \
+    }
+
+// component-wise operations on two vectors and one float
+#define app_v2f(f) \
+    inline vec2 f(const vec2& a, const vec2& b, const vfloat& x) { \
+        return vec2(f(a.x,b.x,x),f(a.y,b.y,x)); \
+    } \
+    inline vec3 f(const vec3& a, const vec3& b, const vfloat& x) { \
+        return vec3(f(a.x,b.x,x),f(a.y,b.y,x),f(a.z,b.z,x)); \
+    } \
+    inline vec4 f(const vec4& a, const vec4& b, const vfloat& x) { \
+        return vec4(f(a.x,b.x,x),f(a.y,b.y,x),f(a.z,b.z,x),f(a.w,b.w,x)); \
+    }
+
+// component-wise operations on three vectors
+#define app_v3(f) \
+    inline vec2 f(const vec2& a, const vec2& b, const vec2& c) { \
+        return vec2(f(a.x,b.x,c.x),f(a.y,b.y,c.y)); \
+    } \
+    inline vec3 f(const vec3& a, const vec3& b, const vec3& c) { \
+        return vec3(f(a.x,b.x,c.x),f(a.y,b.y,c.y),f(a.z,b.z,c.z)); \
+    } \
+    inline vec4 f(const vec4& a, const vec4& b, const vec4& c) { \
+        return vec4(f(a.x,b.x,c.x),f(a.y,b.y,c.y),f(a.z,b.z,c.z),f(a.w,b.w,c.w)); \
+    }
+
+    // angle and trigonometry functions
+    lanes_f(radians)
+    app_v(radians)
+    lanes_f(degrees)
+    app_v(degrees)
+    lanes_f(sin)
+    app_v(sin)
+    lanes_f(cos)
+    app_v(cos)
+    lanes_f(tan)
+    app_v(tan)
+    lanes_f(asin)
+    app_v(asin)
+    lanes_f(acos)
+    app_v(acos)
+    lanes_f(atan)
+    app_v(atan)
+    lanes_f2(atan)
+    app_v2(atan)
+
+    // exponential functions
+    lanes_f2(pow)
+    app_v2(pow)
+    lanes_f(exp)
+    app_v(exp)
+    lanes_f(log)
+    app_v(log)
+    lanes_f(exp2)
+    app_v(exp2)
+    lanes_f(log2)
+    app_v(log2)
+    app_v(sqrt)
+    lanes_f(inversesqrt)
+    app_v(inversesqrt)
+
+    // common functions
+    lanes_f(abs)
+    app_v(abs)
+    lanes_f(sign)
+    app_v(sign)
+    lanes_f(floor)
+    app_v(floor)
+    lanes_f(ceil)
+    app_v(ceil)
+    lanes_f(fract)
+    app_v(fract)
+    lanes_f2(mod)
+    app_v2(mod)
+    app_vf(mod)
+    lanes_f2(min)
+    app_v2(min)
+    app_vf(min)
+    lanes_f2(max)
+    app_v2(max)
+    app_vf(max)
+    lanes_f3(clamp)
+    app_v3(clamp)
+    app_vf2(clamp)
+
+    inline vfloat mix(const vfloat& x, const vfloat& y, const vfloat& a)
+    {
+        return x * (vfloat(1.0f) - a) + y * a;
+    }
+    app_v3(mix)
+    app_v2f(mix)
+
+    lanes_f2(step)
+    app_v2(step)
+    app_fv(step)
+    lanes_f3(smoothstep)
+    app_f2v(smoothstep)
+    app_v3(smoothstep)
+
+#define def_v(f,a,b,expr) \
+    inline vfloat f(const vfloat& a, const vfloat& b) { expr; } \
+    inline vfloat f(const vec2& a, const vec2& b) { expr; } \
+    inline vfloat f(const vec3& a, const vec3& b) { expr; } \
+    inline vfloat f(const vec4& a, const vec4& b) { expr; }
+
+#define defT_v(T,f,args,expr) \
+    inline T f args { expr; }
+
+    inline vfloat length(const vfloat& x)
+    {
+        return abs(x);
+    }
+
+    def_v(distance, a, b,
+        return length(a - b)
+    )
+
+    defT_v(vec2, normalize, (const vec2& x), return x / length(x))
+    defT_v(vec3, normalize, (const vec3& x), return x / length(x))
+    defT_v(vec4, normalize, (const vec4& x), return x / length(x))
+
+    defT_v(vec2, faceforward, (const vec2& N, const vec2& I, const vec2& Nref), return select(dot(Nref, I) < vfloat(0.0f), N, -N))
+    defT_v(vec3, faceforward, (const vec3& N, const vec3& I, const vec3& Nref), return select(dot(Nref, I) < vfloat(0.0f), N, -N))
+    defT_v(vec4, faceforward, (const vec4& N, const vec4& I, const vec4& Nref), return select(dot(Nref, I) < vfloat(0.0f), N, -N))
+
+    defT_v(vec2, reflect, (const vec2& I, const vec2& N), return I - vfloat(2.0f) * dot(N, I) * N)
+    defT_v(vec3, reflect, (const vec3& I, const vec3& N), return I - vfloat(2.0f) * dot(N, I) * N)
+    defT_v(vec4, reflect, (const vec4& I, const vec4& N), return I - vfloat(2.0f) * dot(N, I) * N)
+
+#define def_refract(T) \
+    inline T refract(const T& I, const T& N, const vfloat& eta) { \
+        vfloat k = vfloat(1.0f) - eta * eta * (vfloat(1.0f) - dot(N, I) * dot(N, I)); \
+        return select(k < vfloat(0.0f), I * vfloat(0.0f), eta * I - (eta * dot(N, I) + sqrt(k)) * N); \
+    }
+
+    def_refract(vec2)
+    def_refract(vec3)
+    def_refract(vec4)
+
+    // Lanes (0, 1, 4, 5) and (2, 3, 6, 7) form 2x2 pixel quads. The mip level of a quad comes from the differences
+    // of the texture coordinates across it, as GPUs do, so all four pixels sample the same mips.
+    inline vec4 texture2DLod(const ::sampler2D& sampler, const vec2& uv, const vfloat& lod)
+    {
+        vec4 result;
+        for (int lane = 0; lane < lane_count; ++lane)
+        {
+            const ::vec4 sample = sampler.sample(::vec2(uv.x[lane], uv.y[lane]), lod[lane]);
+            for (int i = 0; i < 4; ++i)
+            {
+                result[i][lane] = sample[i];
+            }
+        }
+        return result;
+    }
+
+    inline vec4 texture2D(const ::sampler2D& sampler, const vec2& uv)
+    {
+        vfloat lod;
+        for (int quad = 0; quad < lane_width; quad += 2)
+        {
+            const float quad_lod = ::textureQuadLod(sampler, ::vec2(uv.x[quad], uv.y[quad]), ::vec2(uv.x[quad + 1], uv.y[quad + 1]),
+                ::vec2(uv.x[quad + lane_width], uv.y[quad + lane_width]));
+            lod[quad] = lod[quad + 1] = lod[quad + lane_width] = lod[quad + lane_width + 1] = quad_lod;
+        }
+        return texture2DLod(sampler, uv, lod);
+    }
+
+#undef lanes_f
+#undef lanes_f2
+#undef lanes_f3
+#undef app_v
+#undef app_vf
+#undef app_fv
+#undef app_vf2
+#undef app_f2v
+#undef app_v2
+#undef app_v2f
+#undef app_v3
+#undef def_v
+#undef defT_v
+#undef def_refract
+#undef lanes_binary
+#undef lanes_compare
+}
@@ -0,0 +1,386 @@
+// Copyright (c) 2019 Petr Petrov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "bgfx_shader.h"
+
+namespace BGFXShaderCPUEmulator
+{
+    enum class TextureFilter : unsigned char
+    {
+        Point,    // Nearest texel of the nearest mip
+        Bilinear, // 2x2 texels of the nearest mip
+        Trilinear // 2x2 texels of the two nearest mips
+    };
+
+    enum class TextureAddress : unsigned char
+    {
+        Wrap,
+        Clamp
+    };
+
+    // Byte order of the texels
+    enum class TextureFormat : unsigned char
+    {
+        RGBA8,
+        BGRA8
+    };
+
+    // 8-bit RGBA texture with a mip chain. Mips made by create() are stored in tiles of tile_size x tile_size texels,
+    // a tile is one 64 byte cache line, so the 2x2 footprint of a bilinear fetch usually touches one line.
+    // Mips given to createFromMemory() are read in place row by row, e.g. straight from a mapped file.
+    class Texture
+    {
+    public:
+        static const unsigned tile_size = 4;
+
+    private:
+        struct Mip
+        {
+            size_t offset; // In storage or in external
+            unsigned width;
+            unsigned height;
+            unsigned tiles_x;
+        };
+
+        std::vector<unsigned char> storage;
+        std::shared_ptr<const unsigned char> external; // Row by row mips owned by someone else, storage is unused then
+        std::vector<Mip> mips;
+        TextureFormat format = TextureFormat::RGBA8;
+
+        static unsigned tileCount(unsigned size)
+        {
+            return (size + tile_size - 1) / tile_size;
+        }
+
+        static size_t tiledOffset(unsigned tiles_x, unsigned x, unsigned y)
+        {
+            return ((static_cast<size_t>(y / tile_size) * tiles_x + x / tile_size) * tile_size * tile_size + (y % tile_size) * tile_size + x % tile_size) * 4;
+        }
+
+        const unsigned char* texel(const Mip& mip, unsigned x, unsigned y) const
+        {
+            if (external)
+            {
+                return external.get() + mip.offset + (static_cast<size_t>(y) * mip.width + x) * 4;
+            }
+            return storage.data() + mip.offset + tiledOffset(mip.tiles_x, x, y);
+        }
+
+        static int address(int coordinate, unsigned size, TextureAddress mode)
+        {
+            if (mode == TextureAddress::Clamp)
+            {
+                return coordinate < 0 ? 0 : coordinate >= static_cast<int>(size) ? static_cast<int>(size) - 1 : coordinate;
+            }
+            const int wrapped = coordinate % static_cast<int>(size);
+            return wrapped < 0 ? wrapped + static_cast<int>(size) : wrapped;
+        }
+
+        // Keeps texture coordinates in a range where texel indices can not overflow, NaN becomes 0
+        static float normalize(float coordinate, TextureAddress mode)
+        {
+            if (mode == TextureAddress::Wrap)
+            {
+                coordinate -= std::floor(coordinate);
+            }
+            if (!(coordinate >= -1.0f && coordinate <= 2.0f))
+            {
+                coordinate = coordinate > 2.0f ? 2.0f : coordinate < -1.0f ? -1.0f : 0.0f;
+            }
+            return coordinate;
+        }
+
+        static vec4 bilinear(const unsigned char* t00, const unsigned char* t10, const unsigned char* t01, const unsigned char* t11, float fx, float fy)
+        {
+#if defined(BGFX_SHADER_SIMD_SSE)
+            const __m128i zero = _mm_setzero_si128();
+            const auto unpack = [&](const unsigned char* texel)
+            {
+                int32_t bits;
+                std::memcpy(&bits, texel, sizeof(bits));
+                return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bits), zero), zero));
+            };
+            const __m128 c00 = unpack(t00);
+            const __m128 c10 = unpack(t10);
+            const __m128 c01 = unpack(t01);
+            const __m128 c11 = unpack(t11);
+            const __m128 wx = _mm_set1_ps(fx);
+            const __m128 top = _mm_add_ps(c00, _mm_mul_ps(_mm_sub_ps(c10, c00), wx));
+            const __m128 bottom = _mm_add_ps(c01, _mm_mul_ps(_mm_sub_ps(c11, c01), wx));
+            const __m128 result = _mm_add_ps(top, _mm_mul_ps(_mm_sub_ps(bottom, top), _mm_set1_ps(fy)));
+            return simd_store(_mm_mul_ps(result, _mm_set1_ps(1.0f / 255.0f)));
+#else
+            vec4 result;
+            for (int i = 0; i < 4; ++i)
+            {
+                const float top = t00[i] + (static_cast<float>(t10[i]) - t00[i]) * fx;
+                const float bottom = t01[i] + (static_cast<float>(t11[i]) - t01[i]) * fx;
+                result[i] = (top + (bottom - top) * fy) * (1.0f / 255.0f);
+            }
+            return result;
+#endif
+        }
+
+        vec4 samplePoint(const Mip& mip, float u, float v, TextureAddress address_u, TextureAddress address_v) const
+        {
+            const int x = address(static_cast<int>(std::floor(u * mip.width)), mip.width, address_u);
+            const int y = address(static_cast<int>(std::floor(v * mip.height)), mip.height, address_v);
+            const unsigned char* t = texel(mip, x, y);
+            const float scale = 1.0f / 255.0f;
+            return vec4(t[0] * scale, t[1] * scale, t[2] * scale, t[3] * scale);
+        }
+
+        vec4 sampleBilinear(const Mip& mip, float u, float v, TextureAddress address_u, TextureAddress address_v) const
+        {
+            const float x = u * mip.width - 0.5f;
+            const float y = v * mip.height - 0.5f;
+            const float x_floor = std::floor(x);
+            const float y_floor = std::floor(y);
+            const int x0 = address(static_cast<int>(x_floor), mip.width, address_u);
+            const int y0 = address(static_cast<int>(y_floor), mip.height, address_v);
+            const int x1 = address(static_cast<int>(x_floor) + 1, mip.width, address_u);
+            const int y1 = address(static_cast<int>(y_floor) + 1, mip.height, address_v);
+            return bilinear(texel(mip, x0, y0), texel(mip, x1, y0), texel(mip, x0, y1), texel(mip, x1, y1), x - x_floor, y - y_floor);
+        }
+
+        // Components in the byte order of the texels
+        vec4 sampleTexels(float u, float v, float lod, TextureFilter filter, TextureAddress address_u, TextureAddress address_v) const
+        {
+            u = normalize(u, address_u);
+            v = normalize(v, address_v);
+            const float max_lod = static_cast<float>(mips.size() - 1);
+            lod = lod > 0.0f ? (lod < max_lod ? lod : max_lod) : 0.0f;
+            if (filter == TextureFilter::Point)
+            {
+                return samplePoint(mips[static_cast<size_t>(lod + 0.5f)], u, v, address_u, address_v);
+            }
+            if (filter == TextureFilter::Bilinear)
+            {
+                return sampleBilinear(mips[static_cast<size_t>(lod + 0.5f)], u, v, address_u, address_v);
+            }
+            const size_t level = static_cast<size_t>(lod);
+            const float blend = lod - static_cast<float>(level);
+            const vec4 near_sample = sampleBilinear(mips[level], u, v, address_u, address_v);
+            if (blend == 0.0f)
+            {
+                return near_sample;
+            }
+            const vec4 far_sample = sampleBilinear(mips[level + 1], u, v, address_u, address_v);
+            return near_sample + (far_sample - near_sample) * blend;
+        }
+
+    public:
+        // RGBA8 texels row by row, the first row is at v = 0. With generate_mips the chain down to 1x1 is built
+        // with a 2x2 box filter, otherwise the texture has one mip.
+        void create(unsigned width, unsigned height, const void* rgba, bool generate_mips = true)
+        {
+            if (!width || !height || !rgba)
+            {
+                std::cerr << "Texture size must be positive and texels must be specified" << std::endl;
+                assert(false);
+                return;
+            }
+
+            std::vector<size_t> offsets;
+            size_t storage_size = 0;
+            unsigned mip_width = width;
+            unsigned mip_height = height;
+            for (;;)
+            {
+                offsets.push_back(storage_size);
+                storage_size += static_cast<size_t>(tileCount(mip_width)) * tileCount(mip_height) * tile_size * tile_size * 4;
+                if (!generate_mips || (mip_width == 1 && mip_height == 1))
+                {
+                    break;
+                }
+                mip_width = std::max(1u, mip_width / 2);
+                mip_height = std::max(1u, mip_height / 2);
+            }
+            storage.assign(storage_size, 0);
+            external.reset();
+            format = TextureFormat::RGBA8;
+
+            mips.clear();
+            mip_width = width;
+            mip_height = height;
+            for (size_t level = 0; level < offsets.size(); ++level)
+            {
+                Mip mip;
+                mip.offset = offsets[level];
+                mip.width = mip_width;
+                mip.height = mip_height;
+                mip.tiles_x = tileCount(mip_width);
+                unsigned char* texels = storage.data() + offsets[level];
+                for (unsigned y = 0; y < mip_height; ++y)
+                {
+                    for (unsigned x = 0; x < mip_width; ++x)
+                    {
+                        unsigned char* destination = texels + tiledOffset(mip.tiles_x, x, y);
+                        if (level == 0)
+                        {
+                            std::memcpy(destination, static_cast<const unsigned char*>(rgba) + (static_cast<size_t>(y) * width + x) * 4, 4);
+                            continue;
+                        }
+                        // Box filter of the parent mip, odd edges reuse the last texel
+                        const Mip& parent = mips[level - 1];
+                        const unsigned x0 = std::min(x * 2, parent.width - 1);
+                        const unsigned y0 = std::min(y * 2, parent.height - 1);
+                        const unsigned x1 = std::min(x * 2 + 1, parent.width - 1);
+                        const unsigned y1 = std::min(y * 2 + 1, parent.height - 1);
+                        for (int i = 0; i < 4; ++i)
+                        {
+                            const unsigned sum = texel(parent, x0, y0)[i] + texel(parent, x1, y0)[i] + texel(parent, x0, y1)[i] + texel(parent, x1, y1)[i];
+                            destination[i] = static_cast<unsigned char>((sum + 2) / 4);
+                        }
+                    }
+                }
+                mips.push_back(mip);
+                mip_width = std::max(1u, mip_width / 2);
+                mip_height = std::max(1u, mip_height / 2);
+            }
+        }
+
+        // Uses texels already in memory without copying them, data is kept alive as long as the texture uses it.
+        // Mip i is max(1, width >> i) x max(1, height >> i) texels stored row by row without padding at mip_offsets[i].
+        void createFromMemory(std::shared_ptr<const unsigned char> data, TextureFormat texel_format, unsigned width, unsigned height,
+            const std::vector<size_t>& mip_offsets)
+        {
+            if (!width || !height || !data || mip_offsets.empty())
+            {
+                std::cerr << "Texture size must be positive and texels must be specified" << std::endl;
+                assert(false);
+                return;
+            }
+
+            storage.clear();
+            storage.shrink_to_fit();
+            external = std::move(data);
+            format = texel_format;
+            mips.clear();
+            for (size_t level = 0; level < mip_offsets.size(); ++level)
+            {
+                Mip mip;
+                mip.offset = mip_offsets[level];
+                mip.width = std::max(1u, width >> level);
+                mip.height = std::max(1u, height >> level);
+                mip.tiles_x = tileCount(mip.width);
+                mips.push_back(mip);
+            }
+        }
+
+        bool empty() const
+        {
+            return mips.empty();
+        }
+
+        unsigned getWidth() const
+        {
+            return mips.empty() ? 0 : mips[0].width;
+        }
+
+        unsigned getHeight() const
+        {
+            return mips.empty() ? 0 : mips[0].height;
+        }
+
+        size_t getMipCount() const
+        {
+            return mips.size();
+        }
+
+        // lod is the mip level, 0 is the full size one. Values below 0 magnify the texture.
+        vec4 sample(float u, float v, float lod, TextureFilter filter, TextureAddress address_u, TextureAddress address_v) const
+        {
+            const vec4 result = sampleTexels(u, v, lod, filter, address_u, address_v);
+            return format == TextureFormat::BGRA8 ? vec4(result.z, result.y, result.x, result.w) : result;
+        }
+    };
+}
+
+// Texture binding of a shader, declared with SAMPLER2D
+struct sampler2D
+{
+    const BGFXShaderCPUEmulator::Texture* texture;
+    BGFXShaderCPUEmulator::TextureFilter filter;
+    BGFXShaderCPUEmulator::TextureAddress address_u;
+    BGFXShaderCPUEmulator::TextureAddress address_v;
+
+    sampler2D()
+        : texture(0), filter(BGFXShaderCPUEmulator::TextureFilter::Trilinear),
+        address_u(BGFXShaderCPUEmulator::TextureAddress::Wrap), address_v(BGFXShaderCPUEmulator::TextureAddress::Wrap)
+    {
+    }
+
+    sampler2D(const BGFXShaderCPUEmulator::Texture& texture_,
+        BGFXShaderCPUEmulator::TextureFilter filter_ = BGFXShaderCPUEmulator::TextureFilter::Trilinear,
+        BGFXShaderCPUEmulator::TextureAddress address_u_ = BGFXShaderCPUEmulator::TextureAddress::Wrap,
+        BGFXShaderCPUEmulator::TextureAddress address_v_ = BGFXShaderCPUEmulator::TextureAddress::Wrap)
+        : texture(&texture_), filter(filter_), address_u(address_u_), address_v(address_v_)
+    {
+    }
+
+    vec4 sample(const vec2& uv, float lod) const
+    {
+        if (!texture || texture->empty())
+        {
+            std::cerr << "Sampler has no texture" << std::endl;
+            assert(false);
+            return vec4(0.0f, 0.0f, 0.0f, 0.0f);
+        }
+        return texture->sample(uv.x, uv.y, lod, filter, address_u, address_v);
+    }
+};
+
+#define SAMPLER2D(_name, _reg) uniform sampler2D _name
+
+// Samples the first mip. Shaders of programs call ShaderContext::texture2D (see bgfx_cpu_emulation.h) or the lane
+// version of bgfx_shader_lanes.h instead, which select the mip from the 2x2 pixel quad with textureQuadLod.
+inline vec4 texture2D(const sampler2D& sampler, const vec2& uv)
+{
+    return sampler.sample(uv, 0.0f);
+}
+
+// Mip level of a 2x2 pixel quad from the texture coordinates of its pixels (x, y), (x + 1, y) and (x, y + 1), as GPUs do
+inline float textureQuadLod(const sampler2D& sampler, const vec2& uv, const vec2& uv_x, const vec2& uv_y)
+{
+    const float width = sampler.texture ? static_cast<float>(sampler.texture->getWidth()) : 0.0f;
+    const float height = sampler.texture ? static_cast<float>(sampler.texture->getHeight()) : 0.0f;
+    const float dudx = (uv_x.x - uv.x) * width;
+    const float dvdx = (uv_x.y - uv.y) * height;
+    const float dudy = (uv_y.x - uv.x) * width;
+    const float dvdy = (uv_y.y - uv.y) * height;
+    const float rho2 = std::max(dudx * dudx + dvdx * dvdx, dudy * dudy + dvdy * dvdy);
+    return rho2 > 0.0f ? 0.5f * std::log2(rho2) : 0.0f;
+}
+
+inline vec4 texture2DLod(const sampler2D& sampler, const vec2& uv, float lod)
+{
+    return sampler.sample(uv, lod);
+}